@@ -0,0 +1,132 @@
+// Old-generation compaction benchmark for the version 4 collector
+//   compactBench [megabytes] [threads...]
+//
+// Fills heap[2] with pretenured blocks of mixed sizes, frees about half of them at random, and times one
+// compacting majorCollection per thread count (default 1 2 4 8). Every run starts from the same heap and
+// checks each surviving block's contents afterwards. Scaling needs at least as many free cores as threads.
+//
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -DHEAP_SIZE=268435456 -DMAX_MANAGED=1500000 -o compactBench compactBench.c v4_dumalloc.c -lpthread
+
+#include <stdio.h>  // printf
+#include <stdlib.h>  // malloc, atoi
+#include <string.h>  // memset
+#include <time.h>  // clock_gettime
+#include <unistd.h>  // sysconf
+
+#include "dumalloc.h"
+
+#define MIN_BLOCK 16
+#define MAX_BLOCK 1024
+
+double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+unsigned long long nextRandom(unsigned long long* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+unsigned char fillByte(int block) {
+	return (unsigned char)(block * 31 + 7);
+}
+
+// Builds the same heap every time; returns the number of blocks allocated
+int buildHeap(long long bytes, void*** handles, int* sizes, int capacity) {
+	unsigned long long random = 88172645463325252ULL;
+	long long allocated = 0;
+	int count = 0;
+
+	duManagedInitMalloc(FIRST_FIT);
+	duSetOldGenMode(OLD_GEN_COMPACT);
+
+	while (allocated < bytes && count < capacity) {
+		int size = MIN_BLOCK + (int)(nextRandom(&random) % (MAX_BLOCK - MIN_BLOCK));
+		void** handle = duManagedMallocHint(size, DU_LIFETIME_LONG);
+
+		if (handle == NULL) {
+			break;
+		}
+
+		memset(*handle, fillByte(count), size);
+		handles[count] = handle;
+		sizes[count] = size;
+		allocated += size;
+		count++;
+	}
+
+	// Highest address first, so every freed block goes to the front of the sorted free list
+	for (int i = count - 1; i >= 0; i--) {
+		if (nextRandom(&random) & 1) {
+			duManagedFree(handles[i]);
+			handles[i] = NULL;
+		}
+	}
+
+	return count;
+}
+
+int main(int argc, char* argv[]) {
+	int megabytes = (argc > 1) ? atoi(argv[1]) : 200;
+	int defaultThreads[] = { 1, 2, 4, 8 };
+	int runs = (argc > 2) ? argc - 2 : 4;
+
+	if (megabytes < 1) {
+		printf("Usage: %s [megabytes] [threads...]\n", argv[0]);
+		return 1;
+	}
+
+	long long bytes = (long long)megabytes * 1024 * 1024;
+	int capacity = (int)(bytes / MIN_BLOCK);
+	void*** handles = malloc(capacity * sizeof(void**));
+	int* sizes = malloc(capacity * sizeof(int));
+
+	printf("%d MiB of blocks, %ld cpus\n", megabytes, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-8s %12s %10s %9s\n", "threads", "compact_ms", "speedup", "blocks");
+
+	double serialMs = 0;
+
+	for (int run = 0; run < runs; run++) {
+		int threads = (argc > 2) ? atoi(argv[run + 2]) : defaultThreads[run];
+		int count = buildHeap(bytes, handles, sizes, capacity);
+		int live = 0;
+
+		threads = duSetCompactThreads(threads);
+
+		double start = nowMs();
+		majorCollection();
+		double elapsedMs = nowMs() - start;
+
+		for (int i = 0; i < count; i++) {
+			if (handles[i] == NULL) {
+				continue;
+			}
+
+			unsigned char* data = *handles[i];
+
+			for (int b = 0; b < sizes[i]; b++) {
+				if (data[b] != fillByte(i)) {
+					printf("Block %d corrupted by compaction with %d threads\n", i, threads);
+					return 1;
+				}
+			}
+
+			live++;
+		}
+
+		if (serialMs == 0) {
+			serialMs = elapsedMs;
+		}
+
+		printf("%-8d %12.2f %9.2fx %9d\n", threads, elapsedMs, serialMs / elapsedMs, live);
+	}
+
+	free(handles);
+	free(sizes);
+	return 0;
+}
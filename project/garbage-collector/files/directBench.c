@@ -0,0 +1,220 @@
+// Pointer-chasing benchmark for direct mode against handles on the version 4 collector
+//   directBench [nodes] [passes]
+//
+// Builds the same shuffled linked list twice, once from handles (each step loads the handle slot, then the
+// node) and once from direct objects (each step loads the node). Walks are timed while everything is still
+// young, and again after minor collections have promoted the list. Collection times are shown as well: direct
+// mode scans the stack, traces the list and fixes up pointer fields on every collection.
+//
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -DHEAP_SIZE=67108864 -DMAX_MANAGED=1100000 -o directBench directBench.c v4_dumalloc.c
+
+#include <stdio.h>  // printf
+#include <stdlib.h>  // malloc, atoi
+#include <time.h>  // clock_gettime
+
+#include "dumalloc.h"
+
+#define COLLECTIONS 3 // Minor collections until the list is promoted (SURVIVAL_COUNT)
+
+typedef struct handleNode {
+	void** next; // Handle of the next node, 0 at the end
+	long value;
+} handleNode;
+
+typedef struct directNode {
+	struct directNode* next; // The pointer field, 0 at the end
+	long value;
+} directNode;
+
+double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+long walkHandles(void** head) {
+	long sum = 0;
+
+	for (void** current = head; current != NULL; current = ((handleNode*)Managed(current))->next) {
+		sum += ((handleNode*)Managed(current))->value;
+	}
+
+	return sum;
+}
+
+long walkDirect(directNode* head) {
+	long sum = 0;
+
+	for (directNode* current = head; current != NULL; current = current->next) {
+		sum += current->value;
+	}
+
+	return sum;
+}
+
+void fail(const char* what) {
+	printf("%s\n", what);
+	exit(1);
+}
+
+// ns per node over all passes, checking every walk against the expected sum
+double timeHandles(void** head, int nodes, int passes, long expected) {
+	double start = nowMs();
+
+	for (int p = 0; p < passes; p++) {
+		if (walkHandles(head) != expected) {
+			fail("handles: list corrupted by the collector");
+		}
+	}
+
+	return (nowMs() - start) * 1e6 / ((double)nodes * passes);
+}
+
+double timeDirect(directNode* head, int nodes, int passes, long expected) {
+	double start = nowMs();
+
+	for (int p = 0; p < passes; p++) {
+		if (walkDirect(head) != expected) {
+			fail("direct: list corrupted by the collector");
+		}
+	}
+
+	return (nowMs() - start) * 1e6 / ((double)nodes * passes);
+}
+
+void runHandles(int nodes, int passes, int* shuffle) {
+	void*** handles = malloc(nodes * sizeof(void**));
+
+	duManagedInitMalloc(FIRST_FIT);
+
+	for (int i = 0; i < nodes; i++) {
+		handles[i] = duManagedMalloc(sizeof(handleNode));
+		if (handles[i] == NULL) {
+			fail("Heap or handle table too small");
+		}
+	}
+
+	void** head = NULL;
+
+	for (int k = 0; k < nodes; k++) {
+		handleNode* n = *handles[shuffle[k]];
+		n->next = (k + 1 < nodes) ? handles[shuffle[k + 1]] : NULL;
+		n->value = k;
+
+		if (k == 0) {
+			head = handles[shuffle[k]];
+		}
+	}
+
+	free(handles);
+
+	long expected = walkHandles(head);
+	double young = timeHandles(head, nodes, passes, expected);
+
+	double start = nowMs();
+	for (int i = 0; i < COLLECTIONS; i++) {
+		minorCollection();
+	}
+	double minorMs = (nowMs() - start) / COLLECTIONS;
+
+	double promoted = timeHandles(head, nodes, passes, expected);
+
+	start = nowMs();
+	majorCollection();
+	double majorMs = nowMs() - start;
+
+	timeHandles(head, nodes, 1, expected);
+	printf("%-7s %10.2f %12.2f %10.3f %10.3f\n", "handle", young, promoted, minorMs, majorMs);
+}
+
+void runDirect(int nodes, int passes, int* shuffle) {
+	// Only the head stays on the stack; the rest of the list is reached through the next fields
+	directNode** objects = malloc(nodes * sizeof(directNode*));
+
+	duManagedInitMalloc(FIRST_FIT);
+
+	for (int i = 0; i < nodes; i++) {
+		objects[i] = duDirectMalloc(sizeof(directNode), 1);
+		if (objects[i] == NULL) {
+			fail("Heap or handle table too small");
+		}
+	}
+
+	directNode* head = NULL;
+
+	for (int k = 0; k < nodes; k++) {
+		directNode* n = objects[shuffle[k]];
+		n->next = (k + 1 < nodes) ? objects[shuffle[k + 1]] : NULL;
+		n->value = k;
+
+		if (k == 0) {
+			head = n;
+		}
+	}
+
+	free(objects); // Collections don't look in malloc'd memory, so this array would go stale anyway
+
+	long expected = walkDirect(head);
+	double young = timeDirect(head, nodes, passes, expected);
+
+	double start = nowMs();
+	for (int i = 0; i < COLLECTIONS; i++) {
+		minorCollection();
+	}
+	double minorMs = (nowMs() - start) / COLLECTIONS;
+
+	double promoted = timeDirect(head, nodes, passes, expected);
+
+	start = nowMs();
+	majorCollection();
+	double majorMs = nowMs() - start;
+
+	timeDirect(head, nodes, 1, expected);
+
+	duStats stats;
+	duGetStats(&stats);
+	if (stats.directFreed != 0) {
+		fail("direct: live nodes were freed");
+	}
+
+	printf("%-7s %10.2f %12.2f %10.3f %10.3f\n", "direct", young, promoted, minorMs, majorMs);
+}
+
+int main(int argc, char* argv[]) {
+	int nodes = (argc > 1) ? atoi(argv[1]) : 1000000;
+	int passes = (argc > 2) ? atoi(argv[2]) : 10;
+
+	if (nodes < 2 || passes < 1) {
+		printf("Usage: %s [nodes] [passes]\n", argv[0]);
+		return 1;
+	}
+
+	// Both lists link their nodes in the same order
+	int* shuffle = malloc(nodes * sizeof(int));
+	unsigned long long random = 88172645463325252ULL;
+
+	for (int i = 0; i < nodes; i++) {
+		shuffle[i] = i;
+	}
+
+	for (int i = nodes - 1; i > 0; i--) {
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+
+		int j = (int)(random % (i + 1));
+		int swap = shuffle[i];
+		shuffle[i] = shuffle[j];
+		shuffle[j] = swap;
+	}
+
+	printf("%d nodes, %d passes\n", nodes, passes);
+	printf("%-7s %10s %12s %10s %10s\n", "mode", "ns/node", "ns/promoted", "minor_ms", "major_ms");
+
+	runHandles(nodes, passes, shuffle);
+	runDirect(nodes, passes, shuffle);
+
+	free(shuffle);
+	return 0;
+}
@@ -0,0 +1,180 @@
+// malloc interposer over the unmanaged duMalloc/duFree path of the version 4 allocator
+// Lets unmodified programs run on dumalloc:
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -shared -fPIC -fvisibility=hidden -o libdumalloc.so dumallocPreload.c v4_dumalloc.c -lpthread
+//   LD_PRELOAD=./libdumalloc.so some-program
+//
+// Hidden visibility keeps the allocator's own globals (heap, stats, ...) from binding to
+// symbols of the same name in the program; only the malloc family below is exported.
+// Nothing is ever collected: blocks have no handles, so this measures the free-list allocator.
+
+#include <stddef.h>  // size_t
+#include <string.h>  // memcpy, memset
+#include <errno.h>  // ENOMEM
+#include <pthread.h>  // pthread_mutex_t
+#include <unistd.h>  // sysconf
+#include <sys/mman.h>  // mmap
+
+#include "dumalloc.h"
+
+#ifndef HEAP_SIZE
+#define HEAP_SIZE (128*8) // Has to match v4_dumalloc.c
+#endif
+
+#define EXPORT __attribute__((visibility("default")))
+#define CHUNK_SIZE (4 * 1024 * 1024) // Memory added each time the heap runs out
+#define MAX_REQUEST (1 << 30) // duMalloc sizes are ints, so larger requests fail
+#define MAX_ALIGNMENT (1 << 20)
+#define HEADER_SIZE 24 // sizeof(memoryBlockHeader)
+
+pthread_mutex_t preloadLock = PTHREAD_MUTEX_INITIALIZER;
+int preloadReady = 0;
+
+// Every block header sits 8 bytes past a 16-byte boundary and every block size is 8 more than a multiple of 16,
+// so splitting keeps the next header on the same footing and every payload comes out 16-byte aligned
+int blockSize(size_t size) {
+	return (int)(((size + 15) & ~(size_t)15) + 8);
+}
+
+void lockForFork() { pthread_mutex_lock(&preloadLock); }
+void unlockAfterFork() { pthread_mutex_unlock(&preloadLock); }
+
+void preloadInit() {
+	duInitMalloc(FIRST_FIT);
+	duSetCoalescing(1);
+
+	// The static heap's first header isn't on the 16-byte footing, so take it out of use
+	duMalloc(HEAP_SIZE - HEADER_SIZE);
+	preloadReady = 1;
+}
+
+int growHeap(int size) {
+	long page = sysconf(_SC_PAGESIZE);
+	long bytes = size + 2 * HEADER_SIZE + 16;
+
+	bytes = (bytes < CHUNK_SIZE) ? CHUNK_SIZE : (bytes + page - 1) / page * page;
+
+	void* chunk = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED) {
+		return 0;
+	}
+
+	// Start 8 bytes in so the first header is on the 16-byte footing
+	duAddHeapChunk((char*)chunk + 8, (int)(bytes - 8));
+	return 1;
+}
+
+void* allocate(size_t size, size_t alignment) {
+	if (size > MAX_REQUEST || alignment > MAX_ALIGNMENT) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	int request = blockSize(size);
+
+	pthread_mutex_lock(&preloadLock);
+
+	if (!preloadReady) {
+		preloadInit();
+		pthread_atfork(lockForFork, unlockAfterFork, unlockAfterFork);
+	}
+
+	void* ptr = (alignment > 16) ? duMallocAligned(request, (int)alignment) : duMalloc(request);
+
+	if (ptr == NULL && growHeap(request + (int)alignment)) {
+		ptr = (alignment > 16) ? duMallocAligned(request, (int)alignment) : duMalloc(request);
+	}
+
+	pthread_mutex_unlock(&preloadLock);
+
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+EXPORT void* malloc(size_t size) {
+	return allocate(size, 16);
+}
+
+EXPORT void free(void* ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&preloadLock);
+	duFree(ptr);
+	pthread_mutex_unlock(&preloadLock);
+}
+
+EXPORT void* calloc(size_t count, size_t size) {
+	if (size != 0 && count > MAX_REQUEST / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void* ptr = allocate(count * size, 16);
+	if (ptr != NULL) {
+		memset(ptr, 0, count * size); // Freed blocks are reused as they are
+	}
+	return ptr;
+}
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+	return (ptr == NULL) ? 0 : (size_t)duUsableSize(ptr);
+}
+
+EXPORT void* realloc(void* ptr, size_t size) {
+	if (ptr == NULL) {
+		return malloc(size);
+	}
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	size_t usable = malloc_usable_size(ptr);
+	if (size <= usable) {
+		return ptr; // Still fits where it is
+	}
+
+	void* moved = malloc(size);
+	if (moved != NULL) {
+		memcpy(moved, ptr, usable);
+		free(ptr);
+	}
+	return moved;
+}
+
+EXPORT int posix_memalign(void** result, size_t alignment, size_t size) {
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+		return EINVAL;
+	}
+
+	void* ptr = allocate(size, alignment);
+	if (ptr == NULL) {
+		return ENOMEM;
+	}
+
+	*result = ptr;
+	return 0;
+}
+
+// The rest of the family has to come from here too, or their blocks would reach our free()
+EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+	void* ptr = NULL;
+	return (posix_memalign(&ptr, alignment, size) == 0) ? ptr : NULL;
+}
+
+EXPORT void* memalign(size_t alignment, size_t size) {
+	return aligned_alloc(alignment, size);
+}
+
+EXPORT void* valloc(size_t size) {
+	return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void* pvalloc(size_t size) {
+	long page = sysconf(_SC_PAGESIZE);
+	return aligned_alloc(page, (size + page - 1) / page * page);
+}
@@ -0,0 +1,260 @@
+// Companion tool for binary heap snapshots written by duHeapSnapshot(out, DU_SNAPSHOT_BINARY)
+//   heapSnapshot heatmap <snapshot>         draws where live and free space sits in each heap
+//   heapSnapshot diff <before> <after>      compares two snapshots of the same program
+//
+// Build it against the version 4 header:
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -o heapSnapshot heapSnapshot.c
+
+#include <stdio.h>  // printf
+#include <stdlib.h>  // calloc
+#include <string.h>  // strcmp
+
+#include "dumalloc.h"
+
+#define HEATMAP_COLUMNS 64
+#define HEATMAP_MAX_ROWS 16
+#define MAX_HEAPS 8
+#define DIFF_DETAILS 20 // Handle changes listed one by one before the rest are only counted
+#define BLOCK_HEADER_SIZE 24 // sizeof(memoryBlockHeader) in v4_dumalloc.c; record sizes leave it out
+
+typedef struct heapSummary {
+	long long liveBytes;
+	long long liveBlocks;
+	long long deadBytes; // Used blocks no handle points at any more
+	long long freeBytes; // On the free list
+	long long freeBlocks;
+	long long largestFree;
+	long long covered; // Bytes the snapshot described; the idle semispace only has its promoted spans
+} heapSummary;
+
+typedef struct snapshot {
+	int heapCount;
+	int currentHeap;
+	int heapSize;
+	int handleCount;
+	int cellBytes; // Heap bytes per heatmap cell
+	int cellCount;
+	heapSummary heaps[MAX_HEAPS];
+	long long* cellLive[MAX_HEAPS]; // Live bytes per cell
+	long long* cellCovered[MAX_HEAPS]; // Bytes of each cell that lie inside described blocks
+	duSnapshotRecord* handles;
+} snapshot;
+
+void addToCells(snapshot* snap, int heap, long long start, long long end, int live) {
+	for (long long cell = start / snap->cellBytes; cell < snap->cellCount && cell * snap->cellBytes < end; cell++) {
+		long long cellStart = cell * snap->cellBytes;
+		long long cellEnd = cellStart + snap->cellBytes;
+		long long overlap = ((end < cellEnd) ? end : cellEnd) - ((start > cellStart) ? start : cellStart);
+
+		snap->cellCovered[heap][cell] += overlap;
+		if (live) {
+			snap->cellLive[heap][cell] += overlap;
+		}
+	}
+}
+
+int loadSnapshot(const char* path, snapshot* snap) {
+	FILE* in = fopen(path, "rb");
+	if (in == NULL) {
+		printf("Can't open %s\n", path);
+		return 0;
+	}
+
+	duSnapshotRecord record;
+	memset(snap, 0, sizeof(*snap));
+
+	if (fread(&record, sizeof(record), 1, in) != 1 || record.kind != DU_SNAPSHOT_MAGIC || record.flags != DU_SNAPSHOT_VERSION) {
+		printf("%s is not a version %d binary heap snapshot\n", path, DU_SNAPSHOT_VERSION);
+		fclose(in);
+		return 0;
+	}
+
+	snap->heapCount = (record.heap < MAX_HEAPS) ? record.heap : MAX_HEAPS;
+	snap->currentHeap = record.offset;
+	snap->heapSize = record.size;
+	snap->handleCount = record.managedIndex;
+
+	// Cells are at least one 8-byte granule wide
+	snap->cellBytes = snap->heapSize / (HEATMAP_COLUMNS * HEATMAP_MAX_ROWS);
+	if (snap->cellBytes < 8) {
+		snap->cellBytes = 8;
+	}
+	snap->cellCount = (snap->heapSize + snap->cellBytes - 1) / snap->cellBytes;
+
+	for (int h = 0; h < snap->heapCount; h++) {
+		snap->cellLive[h] = calloc(snap->cellCount, sizeof(long long));
+		snap->cellCovered[h] = calloc(snap->cellCount, sizeof(long long));
+	}
+	snap->handles = calloc(snap->handleCount + 1, sizeof(duSnapshotRecord));
+
+	// Records are processed as they are read, so only the handle table is kept whole
+	while (fread(&record, sizeof(record), 1, in) == 1 && record.kind != DU_SNAPSHOT_END) {
+		if (record.kind == DU_SNAPSHOT_HANDLE) {
+			if (record.managedIndex >= 0 && record.managedIndex < snap->handleCount) {
+				snap->handles[record.managedIndex] = record;
+			}
+			continue;
+		}
+
+		if (record.heap < 0 || record.heap >= snap->heapCount) {
+			continue;
+		}
+
+		heapSummary* summary = &snap->heaps[record.heap];
+		long long totalSize = record.size + BLOCK_HEADER_SIZE;
+
+		if (record.kind == DU_SNAPSHOT_BLOCK) {
+			int live = (record.flags & DU_SNAPSHOT_REFERENCED) != 0;
+
+			if (live) {
+				summary->liveBytes += totalSize;
+				summary->liveBlocks++;
+			}
+			else if (!(record.flags & DU_SNAPSHOT_FREE)) {
+				summary->deadBytes += totalSize;
+			}
+
+			summary->covered += totalSize;
+			addToCells(snap, record.heap, record.offset, record.offset + totalSize, live);
+		}
+		else if (record.kind == DU_SNAPSHOT_FREE_ENTRY) {
+			summary->freeBytes += totalSize;
+			summary->freeBlocks++;
+			if (totalSize > summary->largestFree) {
+				summary->largestFree = totalSize;
+			}
+		}
+	}
+
+	if (record.kind != DU_SNAPSHOT_END) {
+		printf("%s is truncated\n", path);
+	}
+
+	fclose(in);
+	return 1;
+}
+
+int fragmentation(heapSummary* summary) {
+	if (summary->freeBytes == 0) {
+		return 0;
+	}
+	return 100 - (int)(summary->largestFree * 100 / summary->freeBytes);
+}
+
+void heatmap(snapshot* snap) {
+	const char* shades = ".:-=+*%#"; // Live share of a cell, from none to all of it
+
+	printf("Heap size %d, %d bytes per cell, '.' no live data through '#' all live, ' ' not described\n", snap->heapSize, snap->cellBytes);
+
+	for (int h = 0; h < snap->heapCount; h++) {
+		heapSummary* summary = &snap->heaps[h];
+
+		if (summary->covered == 0) {
+			continue;
+		}
+
+		printf("\nHeap %d%s: live %lld bytes in %lld blocks, dead %lld, free %lld in %lld blocks, largest free %lld, fragmentation %d%%\n",
+			h, (h == snap->currentHeap) ? " (nursery)" : (h == 2) ? " (old)" : " (promoted spans)",
+			summary->liveBytes, summary->liveBlocks, summary->deadBytes, summary->freeBytes, summary->freeBlocks,
+			summary->largestFree, fragmentation(summary));
+
+		for (int row = 0; row * HEATMAP_COLUMNS < snap->cellCount; row++) {
+			char line[HEATMAP_COLUMNS + 1];
+			int width = 0;
+
+			for (int c = row * HEATMAP_COLUMNS; c < snap->cellCount && width < HEATMAP_COLUMNS; c++) {
+				if (snap->cellCovered[h][c] == 0) {
+					line[width++] = ' ';
+				}
+				else {
+					line[width++] = shades[snap->cellLive[h][c] * 7 / snap->cellCovered[h][c]];
+				}
+			}
+
+			line[width] = '\0';
+			printf("%10lld |%s|\n", (long long)row * HEATMAP_COLUMNS * snap->cellBytes, line);
+		}
+	}
+}
+
+void diff(snapshot* before, snapshot* after) {
+	printf("%-6s %14s %14s %14s %12s %12s\n", "heap", "live_before", "live_after", "live_delta", "frag_before", "frag_after");
+
+	for (int h = 0; h < before->heapCount && h < after->heapCount; h++) {
+		printf("%-6d %14lld %14lld %+14lld %11d%% %11d%%\n", h,
+			before->heaps[h].liveBytes, after->heaps[h].liveBytes, after->heaps[h].liveBytes - before->heaps[h].liveBytes,
+			fragmentation(&before->heaps[h]), fragmentation(&after->heaps[h]));
+	}
+
+	int handleCount = (before->handleCount > after->handleCount) ? before->handleCount : after->handleCount;
+	long long allocated = 0, allocatedBytes = 0;
+	long long freed = 0, freedBytes = 0;
+	long long moved = 0, movedBytes = 0;
+	long long promoted = 0, promotedBytes = 0;
+	int details = 0;
+
+	printf("\n");
+
+	for (int i = 0; i < handleCount; i++) {
+		duSnapshotRecord* a = (i < before->handleCount) ? &before->handles[i] : NULL;
+		duSnapshotRecord* b = (i < after->handleCount) ? &after->handles[i] : NULL;
+		int wasLive = a != NULL && a->heap >= 0;
+		int isLive = b != NULL && b->heap >= 0;
+		const char* change = NULL;
+
+		if (!wasLive && isLive) {
+			change = "allocated";
+			allocated++;
+			allocatedBytes += b->size;
+		}
+		else if (wasLive && !isLive) {
+			change = "freed";
+			freed++;
+			freedBytes += a->size;
+		}
+		else if (wasLive && isLive && a->heap != 2 && b->heap == 2) {
+			change = "promoted";
+			promoted++;
+			promotedBytes += b->size;
+		}
+		else if (wasLive && isLive && (a->heap != b->heap || a->offset != b->offset)) {
+			change = "moved";
+			moved++;
+			movedBytes += b->size;
+		}
+
+		if (change != NULL && details < DIFF_DETAILS) {
+			printf("handle %d %s: %d@%d -> %d@%d, size %d\n", i, change,
+				wasLive ? a->heap : -1, wasLive ? a->offset : 0, isLive ? b->heap : -1, isLive ? b->offset : 0, isLive ? b->size : a->size);
+			details++;
+		}
+	}
+
+	printf("\nallocated %lld (%lld bytes), freed %lld (%lld bytes), promoted %lld (%lld bytes), moved %lld (%lld bytes)\n",
+		allocated, allocatedBytes, freed, freedBytes, promoted, promotedBytes, moved, movedBytes);
+}
+
+int main(int argc, char* argv[]) {
+	snapshot first;
+	snapshot second;
+
+	if (argc == 3 && strcmp(argv[1], "heatmap") == 0) {
+		if (!loadSnapshot(argv[2], &first)) {
+			return 1;
+		}
+		heatmap(&first);
+		return 0;
+	}
+
+	if (argc == 4 && strcmp(argv[1], "diff") == 0) {
+		if (!loadSnapshot(argv[2], &first) || !loadSnapshot(argv[3], &second)) {
+			return 1;
+		}
+		diff(&first, &second);
+		return 0;
+	}
+
+	printf("Usage: %s heatmap <snapshot>\n       %s diff <before> <after>\n", argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,227 @@
+// Traversal benchmark for the survivor copy orders of the version 4 collector
+//   localityBench [nodes] [passes]
+//
+// Builds a linked list whose nodes are allocated between long-lived buffers from another call site and
+// linked in shuffled order, collects until everything is promoted, then walks the list. Each copy order
+// gets the same program; what changes is where the collector put the nodes. Hardware counters come from
+// perf_event_open and show as n/a where it isn't allowed; the page and jump figures are measured from the
+// node addresses themselves.
+//
+// Managed() has to stamp accesses for the access order, and the heap has to hold two of everything:
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -DDU_ACCESS_ORDER -DHEAP_SIZE=67108864 -DMAX_MANAGED=450000 -o localityBench localityBench.c v4_dumalloc.c
+
+#include <stdio.h>  // printf
+#include <stdlib.h>  // malloc, atoi
+#include <string.h>  // memset
+#include <time.h>  // clock_gettime
+#include <unistd.h>  // syscall
+#include <sys/ioctl.h>  // ioctl
+#include <sys/syscall.h>  // SYS_perf_event_open
+#include <linux/perf_event.h>  // perf_event_attr
+
+#include "dumalloc.h"
+
+#define BUFFER_SIZE 192 // Long-lived data allocated between the nodes but never walked
+#define PAGE_SIZE 4096
+#define COUNTERS 3
+#define COLLECTIONS 3 // Minor collections until the list is promoted (SURVIVAL_COUNT)
+
+typedef struct node {
+	void** next; // Handle of the next node, 0 at the end
+	long value;
+	long padding[2];
+} node;
+
+const char* counterNames[COUNTERS] = { "L1d", "LLC", "dTLB" };
+unsigned long long counterConfigs[COUNTERS] = {
+	PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+};
+
+double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int openCounter(unsigned long long config) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Separate call sites, so the site order can tell nodes and buffers apart
+__attribute__((noinline)) void** allocateNode() {
+	return duManagedMalloc(sizeof(node));
+}
+
+__attribute__((noinline)) void** allocateBuffer() {
+	return duManagedMalloc(BUFFER_SIZE);
+}
+
+long walk(void** head) {
+	long sum = 0;
+
+	for (void** current = head; current != NULL; current = ((node*)Managed(current))->next) {
+		sum += ((node*)Managed(current))->value;
+	}
+
+	return sum;
+}
+
+int comparePointers(const void* a, const void* b) {
+	unsigned long first = *(const unsigned long*)a;
+	unsigned long second = *(const unsigned long*)b;
+	return (first > second) - (first < second);
+}
+
+void run(const char* name, int order, int nodes, int passes, int* shuffle) {
+	void*** handles = malloc(nodes * sizeof(void**));
+	unsigned long* addresses = malloc(nodes * sizeof(unsigned long));
+
+	duManagedInitMalloc(FIRST_FIT);
+	duSetCopyOrder(order);
+
+	for (int i = 0; i < nodes; i++) {
+		handles[i] = allocateNode();
+		void** buffer = allocateBuffer();
+
+		if (handles[i] == NULL || buffer == NULL) {
+			printf("Heap or handle table too small for %d nodes\n", nodes);
+			exit(1);
+		}
+
+		memset(*buffer, 0, BUFFER_SIZE);
+	}
+
+	// Walk order has nothing to do with allocation order
+	void** head = NULL;
+
+	for (int k = 0; k < nodes; k++) {
+		node* n = *handles[shuffle[k]];
+		n->next = (k + 1 < nodes) ? handles[shuffle[k + 1]] : NULL;
+		n->value = k;
+
+		if (k == 0) {
+			head = handles[shuffle[k]];
+		}
+	}
+
+	long expected = walk(head); // Also what the access order learns from
+
+	for (int i = 0; i < COLLECTIONS; i++) {
+		minorCollection();
+	}
+
+	// Where the nodes ended up: pages they occupy and the average jump between consecutive ones
+	double jumps = 0;
+	unsigned long previous = 0;
+	int count = 0;
+
+	for (void** current = head; current != NULL; current = ((node*)*current)->next) {
+		unsigned long address = (unsigned long)*current;
+
+		if (count > 0) {
+			jumps += (address > previous) ? address - previous : previous - address;
+		}
+
+		addresses[count++] = address / PAGE_SIZE;
+		previous = address;
+	}
+
+	qsort(addresses, count, sizeof(unsigned long), comparePointers);
+
+	int pages = 0;
+	for (int i = 0; i < count; i++) {
+		pages += (i == 0 || addresses[i] != addresses[i - 1]);
+	}
+
+	int fds[COUNTERS];
+	for (int c = 0; c < COUNTERS; c++) {
+		fds[c] = openCounter(counterConfigs[c]);
+		if (fds[c] >= 0) {
+			ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	double start = nowMs();
+
+	for (int p = 0; p < passes; p++) {
+		if (walk(head) != expected) {
+			printf("%s: list corrupted by the collector\n", name);
+			exit(1);
+		}
+	}
+
+	double elapsedNs = (nowMs() - start) * 1e6;
+	double steps = (double)nodes * passes;
+
+	printf("%-7s %10.2f %8d %12.0f", name, elapsedNs / steps, pages, jumps / (count - 1));
+
+	for (int c = 0; c < COUNTERS; c++) {
+		unsigned long long misses = 0;
+
+		if (fds[c] >= 0 && ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0) == 0 && read(fds[c], &misses, sizeof(misses)) == sizeof(misses)) {
+			printf(" %11.3f", misses / steps);
+			close(fds[c]);
+		}
+		else {
+			printf(" %11s", "n/a");
+		}
+	}
+
+	printf("\n");
+
+	free(handles);
+	free(addresses);
+}
+
+int main(int argc, char* argv[]) {
+	int nodes = (argc > 1) ? atoi(argv[1]) : 200000;
+	int passes = (argc > 2) ? atoi(argv[2]) : 20;
+
+	if (nodes < 2 || passes < 1) {
+		printf("Usage: %s [nodes] [passes]\n", argv[0]);
+		return 1;
+	}
+
+	// The same shuffle for every order
+	int* shuffle = malloc(nodes * sizeof(int));
+	unsigned long long random = 88172645463325252ULL;
+
+	for (int i = 0; i < nodes; i++) {
+		shuffle[i] = i;
+	}
+
+	for (int i = nodes - 1; i > 0; i--) {
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+
+		int j = (int)(random % (i + 1));
+		int swap = shuffle[i];
+		shuffle[i] = shuffle[j];
+		shuffle[j] = swap;
+	}
+
+	printf("%d nodes, %d passes, misses per node visited\n", nodes, passes);
+	printf("%-7s %10s %8s %12s %11s %11s %11s\n", "order", "ns/node", "pages", "mean_jump", counterNames[0], counterNames[1], counterNames[2]);
+
+	run("index", DU_COPY_ORDER_INDEX, nodes, passes, shuffle);
+	run("site", DU_COPY_ORDER_SITE, nodes, passes, shuffle);
+	run("access", DU_COPY_ORDER_ACCESS, nodes, passes, shuffle);
+
+	free(shuffle);
+	return 0;
+}
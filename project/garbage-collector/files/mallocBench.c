@@ -0,0 +1,179 @@
+// Benchmarks for the version 4 collector
+//   mallocBench            how long majorCollection takes to compact an old generation
+//                          full of large blocks, with page remapping on and off
+//   mallocBench kernels    throughput of the bulk zero and copy kernels at each CPU level,
+//                          for ranges from 64 KiB up to the heap size
+//
+// The heap size has to match between the allocator and this driver, e.g.
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -DHEAP_SIZE=268435456 -o mallocBench mallocBench.c v4_dumalloc.c
+
+#include <stdio.h>  // printf
+#include <stdlib.h>  // exit
+#include <string.h>  // memset, strcmp
+#include <time.h>  // clock_gettime
+
+#include "dumalloc.h"
+
+#ifndef HEAP_SIZE
+#define HEAP_SIZE (256 * 1024 * 1024)
+#endif
+
+#define LARGE_BLOCK (4 * 1024 * 1024) // Size of each large object
+#define GAP_BLOCK 6000 // Small object between the large ones, freed before compacting
+#define MAX_LARGE 64 // Two handles per large object
+#define REPEATS 5 // Runs per volume, the fastest is reported
+#define KERNEL_BYTES_PER_RUN (256L * 1024 * 1024) // Small ranges are repeated until each timed run moves this much
+
+double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+double timeMajorCollection(int largeCount, int remap) {
+	void** gaps[MAX_LARGE];
+	void** large[MAX_LARGE];
+
+	duManagedInitMalloc(FIRST_FIT);
+	duSetLargeBlockRemap(remap);
+
+	// Large blocks separated by small ones, so every large block has to slide
+	for (int i = 0; i < largeCount; i++) {
+		gaps[i] = duManagedMalloc(GAP_BLOCK);
+		large[i] = duManagedMalloc(LARGE_BLOCK);
+		if (gaps[i] == NULL || large[i] == NULL) {
+			printf("Heap too small for %d large blocks\n", largeCount);
+			exit(1);
+		}
+		memset(*large[i], i + 1, LARGE_BLOCK);
+	}
+
+	// Three minor collections promote everything into the old generation
+	for (int i = 0; i < 3; i++) {
+		minorCollection();
+	}
+
+	for (int i = 0; i < largeCount; i++) {
+		duManagedFree(gaps[i]);
+	}
+
+	double start = nowMs();
+	majorCollection();
+	double elapsed = nowMs() - start;
+
+	// Make sure the blocks came through intact
+	for (int i = 0; i < largeCount; i++) {
+		unsigned char* data = (unsigned char*)*large[i];
+		if (data[0] != (unsigned char)(i + 1) || data[LARGE_BLOCK - 1] != (unsigned char)(i + 1)) {
+			printf("Large block %d was corrupted by compaction\n", i);
+			exit(1);
+		}
+	}
+
+	return elapsed;
+}
+
+double fastestMajorCollection(int largeCount, int remap) {
+	double best = 0;
+
+	for (int r = 0; r < REPEATS; r++) {
+		double ms = timeMajorCollection(largeCount, remap);
+		if (r == 0 || ms < best) {
+			best = ms;
+		}
+	}
+
+	return best;
+}
+
+double kernelGbs(int copy, unsigned char* dest, unsigned char* src, long bytes) {
+	long rounds = (bytes < KERNEL_BYTES_PER_RUN) ? KERNEL_BYTES_PER_RUN / bytes : 1;
+	double best = 0;
+
+	for (int r = 0; r < REPEATS; r++) {
+		double start = nowMs();
+		for (long i = 0; i < rounds; i++) {
+			if (copy) {
+				duBulkCopy(dest, src, bytes);
+			}
+			else {
+				duBulkZero(dest, bytes);
+			}
+		}
+		double ms = nowMs() - start;
+
+		if (r == 0 || ms < best) {
+			best = ms;
+		}
+	}
+
+	return (best > 0) ? (double)bytes * rounds / (best * 1e6) : 0;
+}
+
+void benchKernels() {
+	const char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+	unsigned char* dest = malloc(HEAP_SIZE);
+	unsigned char* src = malloc(HEAP_SIZE);
+
+	if (dest == NULL || src == NULL) {
+		printf("Can't allocate two %d MiB buffers\n", HEAP_SIZE / (1024 * 1024));
+		exit(1);
+	}
+
+	// Fault the pages in first so the first kernel doesn't pay for them
+	memset(dest, 1, HEAP_SIZE);
+	memset(src, 2, HEAP_SIZE);
+
+	printf("Bulk kernel throughput (GB/s, fastest of %d)\n", REPEATS);
+	printf("%12s %8s %10s %10s\n", "bytes", "kernel", "zero_gbs", "copy_gbs");
+
+	for (long bytes = 64 * 1024; bytes <= HEAP_SIZE; bytes *= 4) {
+		for (int level = DU_KERNEL_SCALAR; level <= DU_KERNEL_AVX512; level++) {
+			if (duSetKernelLevel(level) != level) {
+				continue; // Not supported here
+			}
+
+			double zeroGbs = kernelGbs(0, dest, src, bytes);
+			double copyGbs = kernelGbs(1, dest, src, bytes);
+			printf("%12ld %8s %10.2f %10.2f\n", bytes, names[level], zeroGbs, copyGbs);
+		}
+	}
+
+	free(dest);
+	free(src);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 1 && strcmp(argv[1], "kernels") == 0) {
+		benchKernels();
+		return 0;
+	}
+
+	// Stay under the nursery survival rate that promotes whole regions in place
+	int maxLarge = (HEAP_SIZE / 10 * 6) / (LARGE_BLOCK + GAP_BLOCK + 64);
+	if (maxLarge > MAX_LARGE) {
+		maxLarge = MAX_LARGE;
+	}
+
+	printf("majorCollection time vs. large-object volume (%d KiB blocks, heap %d MiB)\n", LARGE_BLOCK / 1024, HEAP_SIZE / (1024 * 1024));
+	printf("%10s %8s %12s %12s\n", "volume_mib", "blocks", "memmove_ms", "remap_ms");
+
+	// Double the volume each step, finishing at the largest that fits
+	for (int count = 1; ; count *= 2) {
+		if (count > maxLarge) {
+			count = maxLarge;
+		}
+
+		double copyMs = fastestMajorCollection(count, 0);
+		double remapMs = fastestMajorCollection(count, 1);
+
+		printf("%10.1f %8d %12.3f %12.3f\n", count * (double)LARGE_BLOCK / (1024 * 1024), count, copyMs, remapMs);
+
+		if (count == maxLarge) {
+			break;
+		}
+	}
+
+	return 0;
+}
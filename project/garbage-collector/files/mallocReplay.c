@@ -0,0 +1,252 @@
+// Replays a recording made with duRecordingStart against this build of the version 4 allocator
+//   mallocReplay <recording> [first|best] [compact|marksweep] [remap|noremap]
+// Options left out keep what the recording run used (remap defaults to on).
+//
+// The heap and handle table have to be big enough for the recorded program, e.g.
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -DHEAP_SIZE=268435456 -DMAX_MANAGED=1000000 -o mallocReplay mallocReplay.c v4_dumalloc.c
+
+#include <stdio.h>  // printf
+#include <stdlib.h>  // malloc
+#include <string.h>  // strcmp
+#include <time.h>  // clock_gettime
+#include <sys/resource.h>  // getrusage
+
+#include "dumalloc.h"
+
+typedef struct recording {
+	unsigned char* data;
+	long length;
+	long position;
+} recording;
+
+double nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+unsigned long long readNumber(recording* rec) {
+	unsigned long long value = 0;
+	int shift = 0;
+
+	while (rec->position < rec->length) {
+		unsigned char byte = rec->data[rec->position++];
+		value |= (unsigned long long)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			break;
+		}
+		shift += 7;
+	}
+
+	return value;
+}
+
+int loadRecording(const char* path, recording* rec) {
+	FILE* in = fopen(path, "rb");
+	if (in == NULL) {
+		printf("Can't open %s\n", path);
+		return 0;
+	}
+
+	// Read it all up front so the replay isn't timing the disk
+	fseek(in, 0, SEEK_END);
+	rec->length = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	rec->data = malloc(rec->length);
+	rec->position = 0;
+
+	if (rec->data == NULL || fread(rec->data, 1, rec->length, in) != (size_t)rec->length) {
+		printf("Can't read %s\n", path);
+		fclose(in);
+		return 0;
+	}
+
+	fclose(in);
+
+	if (rec->length < 4 || memcmp(rec->data, DU_RECORD_MAGIC, 4) != 0) {
+		printf("%s is not a dumalloc recording\n", path);
+		return 0;
+	}
+
+	rec->position = 4;
+	return 1;
+}
+
+// Makes room for handle id, zeroing the new entries
+void*** growHandles(void*** handles, long* capacity, long id) {
+	if (id < *capacity) {
+		return handles;
+	}
+
+	long newCapacity = *capacity;
+	while (newCapacity <= id) {
+		newCapacity *= 2;
+	}
+	handles = realloc(handles, newCapacity * sizeof(void**));
+	memset(handles + *capacity, 0, (newCapacity - *capacity) * sizeof(void**));
+	*capacity = newCapacity;
+
+	return handles;
+}
+
+void printPauses(const char* name, duPauseHistogram* pauses) {
+	printf("%s: %llu, p50 %.3f ms, p99 %.3f ms, max %.3f ms, total %.3f ms\n", name, pauses->count,
+		duPausePercentile(pauses, 50) / 1e6, duPausePercentile(pauses, 99) / 1e6, pauses->maxNs / 1e6, pauses->totalNs / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+	recording rec;
+
+	if (argc < 2) {
+		printf("Usage: %s <recording> [first|best] [compact|marksweep] [remap|noremap]\n", argv[0]);
+		return 1;
+	}
+
+	if (!loadRecording(argv[1], &rec)) {
+		return 1;
+	}
+
+	unsigned long long heapSize = readNumber(&rec);
+	int strategy = (int)readNumber(&rec);
+	int oldGenMode = (int)readNumber(&rec);
+	long handleBase = (long)readNumber(&rec); // Handles from before the recording started are unknown here
+	int remap = 1;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "first") == 0) strategy = FIRST_FIT;
+		else if (strcmp(argv[i], "best") == 0) strategy = BEST_FIT;
+		else if (strcmp(argv[i], "compact") == 0) oldGenMode = OLD_GEN_COMPACT;
+		else if (strcmp(argv[i], "marksweep") == 0) oldGenMode = OLD_GEN_MARK_SWEEP;
+		else if (strcmp(argv[i], "remap") == 0) remap = 1;
+		else if (strcmp(argv[i], "noremap") == 0) remap = 0;
+		else {
+			printf("Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	// Recorded handle ids map to the handles this replay got back
+	long handleCapacity = 1024;
+	void*** handles = calloc(handleCapacity, sizeof(void**));
+
+	long long allocations = 0, frees = 0, moves = 0, minors = 0, majors = 0;
+	long long recordedFailures = 0, replayFailures = 0, extraCollections = 0;
+	int worstFragmentation = 0;
+	double excludedMs = 0; // Time spent measuring, left out of the throughput
+
+	duManagedInitMalloc(strategy);
+	duSetOldGenMode(oldGenMode);
+	duSetLargeBlockRemap(remap);
+
+	double start = nowMs();
+
+	while (rec.position < rec.length) {
+		int op = rec.data[rec.position++];
+
+		if (op == DU_RECORD_END) {
+			break;
+		}
+
+		if (op == DU_RECORD_MALLOC || op == DU_RECORD_MALLOC_OLD) {
+			int lifetime = (op == DU_RECORD_MALLOC_OLD) ? DU_LIFETIME_LONG : DU_LIFETIME_SHORT; // Place it where the recording did
+			int size = (int)readNumber(&rec);
+			long id = (long)readNumber(&rec) - 1;
+
+			if (id < 0) {
+				recordedFailures++; // The program got nothing back, so it never used this
+				continue;
+			}
+
+			handles = growHandles(handles, &handleCapacity, id);
+
+			void** handle = duManagedMallocHint(size, lifetime);
+			if (handle == NULL) {
+				// This configuration ran out where the recorded one didn't, so collect and try once more
+				minorCollection();
+				majorCollection();
+				extraCollections += 2;
+				handle = duManagedMallocHint(size, lifetime);
+			}
+			if (handle == NULL) {
+				replayFailures++;
+			}
+
+			handles[id] = handle;
+			allocations++;
+		}
+		else if (op == DU_RECORD_FREE) {
+			long id = (long)readNumber(&rec);
+
+			if (id >= handleBase && id < handleCapacity && handles[id] != NULL) {
+				duManagedFree(handles[id]);
+				handles[id] = NULL;
+			}
+			frees++;
+		}
+		else if (op == DU_RECORD_MOVE) {
+			long from = (long)readNumber(&rec);
+			long to = (long)readNumber(&rec);
+
+			// A scope handed its block to another handle; the replay's own handle carries over
+			handles = growHandles(handles, &handleCapacity, to);
+			if (from >= handleBase && from < handleCapacity && handles[from] != NULL) {
+				handles[to] = handles[from];
+				handles[from] = NULL;
+			}
+			moves++;
+		}
+		else if (op == DU_RECORD_MINOR || op == DU_RECORD_MAJOR) {
+			if (op == DU_RECORD_MINOR) {
+				minorCollection();
+				minors++;
+			}
+			else {
+				majorCollection();
+				majors++;
+			}
+
+			double measureStart = nowMs();
+			duStats stats;
+			duGetStats(&stats);
+			if (stats.oldFragmentation > worstFragmentation) {
+				worstFragmentation = stats.oldFragmentation;
+			}
+			excludedMs += nowMs() - measureStart;
+		}
+		else if (op == DU_RECORD_INIT) {
+			int recordedStrategy = (int)readNumber(&rec);
+			(void)recordedStrategy; // The replay's own strategy wins
+			duManagedInitMalloc(strategy);
+			memset(handles, 0, handleCapacity * sizeof(void**));
+			handleBase = 0;
+		}
+		else {
+			printf("Corrupt recording: unknown op %d at byte %ld\n", op, rec.position - 1);
+			return 1;
+		}
+	}
+
+	double elapsedMs = nowMs() - start - excludedMs;
+	long long ops = allocations + frees + moves + minors + majors;
+
+	duStats stats;
+	duGetStats(&stats);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("recording heap size %llu, replay strategy %s, old generation %s, remap %s\n", heapSize,
+		(strategy == FIRST_FIT) ? "first fit" : "best fit", (oldGenMode == OLD_GEN_COMPACT) ? "compact" : "mark-sweep", remap ? "on" : "off");
+	printf("ops: %lld (%lld mallocs, %lld frees, %lld moves, %lld minor, %lld major)\n", ops, allocations, frees, moves, minors, majors);
+	printf("time: %.3f ms, throughput %.0f ops/sec\n", elapsedMs, (elapsedMs > 0) ? ops / (elapsedMs / 1000.0) : 0.0);
+	printf("failures: %lld recorded, %lld in replay, %lld extra collections\n", recordedFailures, replayFailures, extraCollections);
+	printf("peak rss: %ld KiB\n", usage.ru_maxrss);
+	printf("old generation fragmentation: %d%% at the end, %d%% worst after a collection\n", stats.oldFragmentation, worstFragmentation);
+	printf("bytes requested %llu, reserved %llu, survived %llu, promoted %llu\n",
+		stats.bytesRequested, stats.bytesReserved, stats.survivorBytes, stats.promotedBytes);
+	printPauses("minor pauses", &stats.minorPauses);
+	printPauses("major pauses", &stats.majorPauses);
+
+	return 0;
+}
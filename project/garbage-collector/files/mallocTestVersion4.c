@@ -158,6 +158,50 @@ void test() {
 	printf("\nMemory access is: %s\n", Managed(a1));
 }
 
+// A weak handle cleared inside a scope must not leave its slot weak for whoever gets it next
+void testScopeWeak() {
+	printf("\n********* SCOPE WITH A WEAK HANDLE ***********\n");
+	duHandleScope scope;
+	duHandleScopeOpen(&scope);
+
+	Managed_t(char*) w = (Managed_t(char*))duManagedMalloc(32);
+	if (w == NULL) {
+		printf("Call to DuMalloc failed\n");
+		exit(1);
+	}
+	duSetWeak((void**)w, 1);
+
+	// Nothing else refers to w, so this clears it
+	minorCollection();
+	printf("\nWeak handle after collection: %s\n", (Managed(w) == NULL) ? "cleared" : "kept");
+
+	duHandleScopeClose(&scope);
+
+	// These take the slots the scope dropped, w's included
+	Managed_t(char*) b0 = (Managed_t(char*))duManagedMalloc(32);
+	Managed_t(char*) b1 = (Managed_t(char*))duManagedMalloc(32);
+	if (b0 == NULL || b1 == NULL) {
+		printf("Call to DuMalloc failed\n");
+		exit(1);
+	}
+
+	Managed(b1)[0] = 'B';
+	Managed(b1)[1] = 'o';
+	Managed(b1)[2] = 'u';
+	Managed(b1)[3] = 'l';
+	Managed(b1)[4] = 'd';
+	Managed(b1)[5] = 'e';
+	Managed(b1)[6] = 'r';
+	Managed(b1)[7] = '\0';
+
+	// b1 is strong, so it has to survive this
+	minorCollection();
+	printf("\nMemory access is: %s\n", (Managed(b1) == NULL) ? "(cleared)" : Managed(b1));
+
+	duManagedFree((Managed_t(void*))b0);
+	duManagedFree((Managed_t(void*))b1);
+}
+
 int main(int argc, char* argv[]) {
 
 	// Must be first call in the program to get DuMalloc going
@@ -166,4 +210,5 @@ int main(int argc, char* argv[]) {
 	duMemoryDump();
 
 	test();
+	testScopeWeak();
 }
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Builds workloadBench against every allocator and prints all results as one JSON document
+#   ./runWorkloadBench.sh [ops] > results.json
+# HEAP_SIZE and MAX_MANAGED can be set in the environment.
+
+OPS=${1:-200000}
+HEAP_SIZE=${HEAP_SIZE:-4194304}
+MAX_MANAGED=${MAX_MANAGED:-$((OPS + 10000))} # Handles are never reused, so every allocation needs one
+CC=${CC:-gcc}
+SRC=$(cd "$(dirname "$0")" && pwd)
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+build() {
+	# $1 = allocator name, $2 = version number or empty for the C library
+	mkdir -p "$BUILD/$1"
+	if [ -n "$2" ]; then
+		cp "$SRC/v$2_dumalloc.h" "$BUILD/$1/dumalloc.h"
+		$CC -O2 -DBENCH_V$2 -DHEAP_SIZE=$HEAP_SIZE -DMAX_MANAGED=$MAX_MANAGED -I"$BUILD/$1" \
+			-o "$BUILD/$1/workloadBench" "$SRC/workloadBench.c" "$SRC/v$2_dumalloc.c" -lm || exit 1
+	else
+		$CC -O2 -DBENCH_SYSTEM -DHEAP_SIZE=$HEAP_SIZE -o "$BUILD/$1/workloadBench" "$SRC/workloadBench.c" -lm || exit 1
+	fi
+}
+
+build glibc ""
+for v in 1 2 3 4; do
+	build v$v $v
+done
+
+echo "{\"ops\":$OPS,\"heap_size\":$HEAP_SIZE,\"results\":["
+first=1
+for allocator in glibc v1 v2 v3 v4; do
+	for strategy in first best; do
+		# The C library has no placement strategy to choose
+		if [ $allocator = glibc ] && [ $strategy = best ]; then
+			continue
+		fi
+		for workload in fixed_churn pareto_lifetimes producer_consumer large_mix; do
+			[ $first = 1 ] || echo ","
+			first=0
+			"$BUILD/$allocator/workloadBench" $workload $strategy $OPS | tr -d '\n'
+		done
+	done
+done
+echo
+echo "]}"
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include "dumalloc.h"
 
-#define HEAP_SIZE 128*8 // 1024 bytes
+#ifndef HEAP_SIZE
+#define HEAP_SIZE (128*8) // 1024 bytes
+#endif
 #define FIRST_FIT 0
 #define BEST_FIT 1
 
@@ -157,8 +159,8 @@ void* duMalloc(int size)
                 void* userBlock = (unsigned char*)current + sizeof(memoryBlockHeader);
                 current->free = 0; // Mark block as used
 
-                // Exact fit — remove the block from the free list
-                if (current->size == size)
+                // Exact fit (or a remainder too small for a header) — remove the block from the free list
+                if (current->size - size < (int)sizeof(memoryBlockHeader))
                 {
                     if (current == freeListHead)
                     {
@@ -230,8 +232,8 @@ void* duMalloc(int size)
         void* userBlock = (unsigned char*)best + sizeof(memoryBlockHeader);
         best->free = 0; // Mark block as used
 
-        // Exact fit — remove the block from the free list
-        if (best->size == size)
+        // Exact fit (or a remainder too small for a header) — remove the block from the free list
+        if (best->size - size < (int)sizeof(memoryBlockHeader))
         {
             if (best == freeListHead)
             {
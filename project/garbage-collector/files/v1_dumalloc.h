@@ -6,8 +6,8 @@
 #define FIRST_FIT 0
 #define BEST_FIT 1
 
-void duInitMalloc(int size, int strategy);
-void* duMalloc(size_t size);
+void duInitMalloc(int searchType);
+void* duMalloc(int size);
 void duFree(void* ptr);
 void duMemoryDump();
 
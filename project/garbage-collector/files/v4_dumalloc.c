@@ -1,22 +1,184 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // mremap
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <setjmp.h>
 #include "dumalloc.h"
 
-#define HEAP_SIZE 128*8 // 1024 bytes
+// Everything below the heap arrays is optional. DU_STATIC_HEAP builds only on the static heaps, for targets
+// without mmap, fork or backtrace: large blocks are copied, async snapshots fail and profiles keep one frame.
+#if defined(__linux__) && !defined(DU_STATIC_HEAP)
+#define DU_HOSTED
+#endif
+
+#ifdef DU_HOSTED
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#endif
+
+// Vector kernels for bulk zeroing and copying, picked at run time for the CPU
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DU_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#ifndef HEAP_SIZE
+#define HEAP_SIZE (128*8) // 1024 bytes
+#endif
 #define FIRST_FIT 0
 #define BEST_FIT 1
+
+// -DDU_FIT_POLICY=FIRST_FIT or BEST_FIT fixes the strategy at build time, so duMalloc carries only that
+// search loop and the searchType passed to duInitMalloc is ignored
+#ifdef DU_FIT_POLICY
+#define ALLOCATION_STRATEGY DU_FIT_POLICY
+#else
+#define ALLOCATION_STRATEGY allocationStrategy
+#endif
+#ifndef MAX_MANAGED
 #define MAX_MANAGED 128
+#endif
 
 #define HEAP_COUNT 3 // Number of heaps
+#ifndef SURVIVAL_COUNT
 #define SURVIVAL_COUNT 3 // Number of minor collections before promotion
+#endif
+
+#ifndef NURSERY_REGION_SIZE
+#define NURSERY_REGION_SIZE 256 // Size of one nursery region in bytes
+#endif
+#define NURSERY_REGION_COUNT (HEAP_SIZE / NURSERY_REGION_SIZE)
+#ifndef NURSERY_PROMOTE_PERCENT
+#define NURSERY_PROMOTE_PERCENT 75 // Nursery survival (percent of HEAP_SIZE) before regions are promoted whole
+#endif
+#ifndef REGION_PROMOTE_PERCENT
+#define REGION_PROMOTE_PERCENT 80 // Live percent a region needs to be promoted in place
+#endif
+#ifndef MAX_TENURED_SPANS
+#define MAX_TENURED_SPANS 16 // Promoted-in-place spans each semispace can hold
+#endif
+#ifndef PLAB_SIZE
+#define PLAB_SIZE 256 // Smallest chunk of old space taken at once for promotion
+#endif
+#ifndef SWEEP_BATCH
+#define SWEEP_BATCH 8 // Blocks examined per step of lazy sweeping
+#endif
+#ifndef COMPACT_FRAGMENTATION_PERCENT
+#define COMPACT_FRAGMENTATION_PERCENT 50 // Old-generation fragmentation at which mark-sweep compacts instead
+#endif
+#define REMAP_PAGE_SIZE 4096 // Page size the heaps are aligned to
+#ifndef REMAP_THRESHOLD
+#define REMAP_THRESHOLD (256 * REMAP_PAGE_SIZE) // Blocks at least this big (1 MiB) are moved by remapping their pages; below that the system calls cost more than copying
+#endif
+#ifndef REMAP_MAX_MAPPINGS
+#define REMAP_MAX_MAPPINGS 8192 // Mappings remapping may split heap[2] into; vm.max_map_count (65530 by default) caps the whole process
+#endif
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 4096 // Events each thread keeps before overwriting the oldest
+#endif
+#ifndef TRACE_MAX_THREADS
+#define TRACE_MAX_THREADS 16 // Threads that can record events
+#endif
+#ifndef PROFILE_MAX_SITES
+#define PROFILE_MAX_SITES 1024 // Distinct allocation stacks the profiler can tell apart
+#endif
+#ifndef PROFILE_MAX_DEPTH
+#define PROFILE_MAX_DEPTH 32 // Frames kept per sampled stack
+#endif
+#ifndef PRETENURE_SITES
+#define PRETENURE_SITES 256 // Call sites whose promotion rates auto-pretenuring keeps
+#endif
+#ifndef PRETENURE_MIN_SAMPLES
+#define PRETENURE_MIN_SAMPLES 8 // Profile samples a site needs before it can be pretenured
+#endif
+#ifndef PRETENURE_PERCENT
+#define PRETENURE_PERCENT 80 // Share of a site's samples that have to reach the old generation
+#endif
+#define PRETENURE_DECAY_SAMPLES 1024 // Counts are halved at this many samples so sites can change their minds
+#ifndef STREAM_THRESHOLD
+#define STREAM_THRESHOLD (1024 * 1024) // Ranges at least this big are written with non-temporal stores so they don't flush the cache
+#endif
+#define KERNEL_MIN_BYTES 256 // Below this the C library's memset and memcpy are just as fast
+#ifndef ARENA_SIZE
+#define ARENA_SIZE HEAP_SIZE // Bytes all open arena scopes share
+#endif
+#ifndef MAX_ARENA_DEPTH
+#define MAX_ARENA_DEPTH 16 // Arena scopes that can be open at once
+#endif
+#ifndef MAX_ASYNC_SNAPSHOTS
+#define MAX_ASYNC_SNAPSHOTS 2 // Forked snapshot writers allowed at once; each can end up holding a copy of the heap
+#endif
+#ifndef MAX_PRESSURE_CALLBACKS
+#define MAX_PRESSURE_CALLBACKS 8 // Memory-pressure callbacks that can be registered at once
+#endif
+#ifndef MAX_COMPACT_THREADS
+#define MAX_COMPACT_THREADS 16 // Threads majorCollection can compact heap[2] with
+#endif
+#ifndef COMPACT_REGION_SIZE
+#define COMPACT_REGION_SIZE 65536 // Granularity of the live-byte summary parallel compaction divides heap[2] by
+#endif
+#define COMPACT_REGION_COUNT ((HEAP_SIZE + COMPACT_REGION_SIZE - 1) / COMPACT_REGION_SIZE)
+#ifndef PARALLEL_COMPACT_MIN_BYTES
+#define PARALLEL_COMPACT_MIN_BYTES (1024 * 1024) // Live bytes in heap[2] below which starting threads costs more than it saves
+#endif
+#define HEAP_LIMIT_REARM_DIVISOR 8 // Still over the limit after collecting, usage has to grow by limit/8 before the next try
+
+#if HEAP_SIZE % NURSERY_REGION_SIZE != 0 || HEAP_SIZE % 8 != 0
+#error HEAP_SIZE has to be a multiple of NURSERY_REGION_SIZE and of 8
+#endif
+#if SURVIVAL_COUNT < 1 || MAX_TENURED_SPANS < 1 || MAX_ARENA_DEPTH < 1
+#error SURVIVAL_COUNT, MAX_TENURED_SPANS and MAX_ARENA_DEPTH have to be at least 1
+#endif
+
+// Records a trace event; when tracing is off this is a single branch
+#define TRACE_EVENT(name, phase, arg) do { if (__builtin_expect(traceEnabled, 0)) { traceRecord(name, phase, arg); } } while (0)
 
 int allocationStrategy = FIRST_FIT; // default
+int oldGenMode = OLD_GEN_COMPACT; // How majorCollection reclaims heap[2]
+int largeBlockRemap = 1; // Let compaction move large blocks by remapping pages
+int remapMappings = 0; // Mappings remapBlock may have split heap[2] into since mergeRemappedHeap last made it one
+int coalesceFreeBlocks = 0; // Merge freed blocks with free neighbours (the malloc interposer turns this on)
+int recycleHandles = 0; // Reuse the managedList slots duManagedFree releases
 
-unsigned char heap[HEAP_COUNT][HEAP_SIZE]; // The heap is a static array of bytes
+unsigned char heap[HEAP_COUNT][HEAP_SIZE] __attribute__((aligned(REMAP_PAGE_SIZE))); // The heap is a static array of bytes
 int currentHeap = 0; // Current heap index
+int heapDirtyBytes[HEAP_COUNT]; // Bytes from the start of each heap that may be non-zero; the rest needs no clearing
 void *managedList[MAX_MANAGED]; // Array to keep track of managed pointers
 int managedListSize = 0;
+int managedPinCount[MAX_MANAGED]; // duPin calls not yet undone; collections leave pinned blocks where they are
+int freeHandles[MAX_MANAGED]; // Released managedList slots below managedListSize, reused before new ones
+int freeHandleCount = 0;
+int handleScopeDepth = 0; // Open handle scopes; while any is open new handles go on top of the list
+unsigned char managedWeak[MAX_MANAGED]; // 1 for weak handles, which collections clear instead of keeping their block
+int weakNotify = 0; // Queue the slots of weak handles collections clear
+int weakCleared[MAX_MANAGED]; // Ring of cleared slots waiting for duNextClearedWeak
+int weakClearedHead = 0;
+int weakClearedCount = 0;
+
+int copyOrder = DU_COPY_ORDER_INDEX; // Order minorCollection copies survivors in
+int allocationSite[MAX_MANAGED]; // pretenureSites slot of each handle's call site, PRETENURE_SITES if unknown
+unsigned int duAccessClock = 0; // Bumped by Managed() in DU_ACCESS_ORDER builds
+unsigned int duAccessStamp[MAX_MANAGED]; // Clock at each handle's last Managed(), 0 if never touched
+int survivorOrder[MAX_MANAGED]; // Young handles in the order this minorCollection copies them
+
+// Direct mode: objects handed out as raw pointers still get a managedList slot, which only the collector uses.
+// Each collection works out which of them are reachable before it starts and fixes up their pointer fields after.
+int directPointerWords[MAX_MANAGED]; // Leading pointer words of each direct object, -1 for ordinary handles
+int directLive = 0; // Direct objects allocated and not yet freed
+void* stackBase = 0; // Highest address of the stack, where conservative scanning stops
+int directSorted[MAX_MANAGED]; // Direct slots of this collection by address
+void* directOldAddress[MAX_MANAGED]; // Their addresses when it started, in the same order
+int directSortedCount = 0;
+unsigned char directReached[MAX_MANAGED]; // 0 unreached, 1 reached through a pointer field, 2 pinned by the stack
+int directWork[MAX_MANAGED]; // Reached slots whose pointer fields haven't been scanned yet
+int directWorkCount = 0;
 
 typedef struct memoryBlockHeader {
     int free;           // 0 = used, 1 = free
@@ -29,50 +191,406 @@ typedef struct memoryBlockHeader {
 
 memoryBlockHeader* freeListHead[HEAP_COUNT]; // Pointer to the head of the free list
 
+int regionLiveBytes[NURSERY_REGION_COUNT]; // Live bytes per region of the from-space, filled in by minorCollection
+
+// Tenured spans are ranges of a semispace that were promoted in place and now belong to the old generation.
+// They are kept sorted by address and never overlap.
+unsigned char* tenuredStart[2][MAX_TENURED_SPANS];
+unsigned char* tenuredEnd[2][MAX_TENURED_SPANS];
+int tenuredCount[2];
+
+// Promotion-local allocation buffer: a chunk of heap[2] that minorCollection bump-allocates promoted blocks into
+unsigned char* plabTop = 0; // Next free byte in the buffer
+unsigned char* plabEnd = 0; // End of the buffer
+memoryBlockHeader* plabLast = 0; // Last block placed in the buffer
+
+// Mark-sweep state for heap[2]: one mark bit per 8-byte granule, and how far lazy sweeping has got
+unsigned long long markBits[(HEAP_SIZE / 8 + 63) / 64];
+
+// Side metadata for heap[2]: one bit per granule where a block header starts. Together with markBits it lets
+// sweeps and compaction find blocks by scanning dense bitmaps, without reading dead blocks' headers.
+int sideMetadata = 0;
+unsigned long long blockStartBits[(HEAP_SIZE / 8 + 63) / 64];
+// Parallel compaction cuts heap[2] into chunks of about equal live bytes, each slid down by its own thread.
+// A chunk's blocks only move into the space between the previous chunk's last live block and its own, so
+// no two threads ever touch the same bytes. Each chunk keeps its gaps until they are linked up afterwards.
+typedef struct compactChunk {
+    unsigned char* srcStart;      // First block of the chunk
+    unsigned char* srcEnd;        // End of its last live block (the heap's end for the last chunk)
+    unsigned char* dest;          // Where its first live block goes; once compacted, the end of what was moved
+    int useMarks;                 // Step from live block to live block with the mark bits
+    memoryBlockHeader* freeHead;  // Gaps left inside the chunk, in address order
+    memoryBlockHeader* freeTail;
+} compactChunk;
+
+int compactThreads = 1;
+long long compactRegionLive[COMPACT_REGION_COUNT]; // Live bytes of the blocks starting in each region
+unsigned char* compactRegionEnd[COMPACT_REGION_COUNT]; // End of the last live block starting in it, 0 if none
+unsigned char* sweepCursor = 0; // Next block to sweep, 0 when there is nothing left to sweep
+unsigned char* sweepRunStart = 0; // Start of the run of dead blocks being gathered into one free block
+
+duStats stats; // Running counters; duGetStats fills in the free-list figures when asked
+
+// Trace events are buffered per thread in fixed rings, so recording never allocates or locks
+typedef struct traceEvent {
+    const char* name;
+    char phase;     // 'B' begin, 'E' end, 'i' instant, as in the Chrome trace format
+    long long ts;   // Nanoseconds
+    long long arg;  // Bytes involved, or -1
+} traceEvent;
+
+typedef struct traceRing {
+    unsigned long long written; // Events recorded so far; the ring keeps the last TRACE_RING_SIZE
+    traceEvent events[TRACE_RING_SIZE];
+} traceRing;
+
+int traceEnabled = 0;
+traceRing traceRings[TRACE_MAX_THREADS];
+int traceRingCount = 0; // Rings handed out to threads
+__thread traceRing* threadTraceRing = 0;
+
+// Heap profiler: allocation sites found by sampling, and which handle holds each live sample
+typedef struct profileSite {
+    int depth;  // 0 while the slot is unused
+    void* stack[PROFILE_MAX_DEPTH];
+    long long allocObjects;
+    long long allocBytes;
+    long long liveObjects;
+    long long liveBytes;
+    long long promotedObjects;
+    long long promotedBytes;
+} profileSite;
+
+long long profileSampleRate = 0; // Average bytes between samples, 0 when profiling is off
+long long profileBytesUntilSample = 0;
+unsigned long long profileRandom = 88172645463325252ULL; // xorshift state for picking sample points
+profileSite profileSites[PROFILE_MAX_SITES];
+int profileSiteOf[MAX_MANAGED]; // Site of the sample held by each handle, -1 if it isn't sampled
+int profileSizeOf[MAX_MANAGED]; // Reserved size of that sample
+
+// Promotion rates by the address duManagedMalloc returns to, learned from profile samples
+typedef struct pretenureSite {
+    void* caller;  // 0 while the slot is unused
+    int samples;
+    int promoted;  // Samples that reached the old generation
+} pretenureSite;
+
+int autoPretenure = 0; // Send UNKNOWN allocations from mostly-promoted sites straight to the old generation
+pretenureSite pretenureSites[PRETENURE_SITES];
+
+// Snapshots being written by forked children
+typedef struct asyncSnapshot {
+    int pid;     // 0 when the slot is free
+    int readFd;  // Parent's end of the completion pipe
+    duSnapshotCallback done;
+    void* context;
+} asyncSnapshot;
+
+asyncSnapshot asyncSnapshots[MAX_ASYNC_SNAPSHOTS];
+
+FILE* recordingOut = 0; // Where managed calls are logged for replay, 0 when not recording
+
+// Leads a heap image file. managedList, freeHandles, markBits and managedWeak follow it, then the heaps from imageHeapOffset
+typedef struct heapImage {
+    char magic[8];
+    int heapSize;
+    int heapCount;
+    int maxManaged;
+    int headerSize;             // sizeof(memoryBlockHeader), which the heap contents depend on
+    long long heapBase;         // Address heap[0] had in the saving process; every pointer is rebased from it
+    long long heapOffset;       // File offset of the heaps, a multiple of the page size so they can be mapped
+    int currentHeap;
+    int allocationStrategy;
+    int oldGenMode;
+    int managedListSize;
+    int freeHandleCount;
+    int tenuredCount[2];
+    void* freeListHead[HEAP_COUNT];
+    void* tenuredStart[2][MAX_TENURED_SPANS];
+    void* tenuredEnd[2][MAX_TENURED_SPANS];
+    void* plabTop;
+    void* plabEnd;
+    void* plabLast;
+    void* sweepCursor;
+    void* sweepRunStart;
+} heapImage;
+
+int kernelLevel = -1; // DU_KERNEL_* in use, -1 until duInitMalloc picks one
+void (*zeroKernel)(unsigned char* dest, long bytes) = 0; // 0 means memset
+void (*copyKernel)(unsigned char* dest, const unsigned char* src, long bytes) = 0; // 0 means memcpy
+
+// Arena scopes bump-allocate from one region outside the collected heaps; ending a scope drops its top back
+unsigned char arena[ARENA_SIZE] __attribute__((aligned(8)));
+unsigned char* arenaTop = arena; // Next free byte
+unsigned char* arenaScopeStart[MAX_ARENA_DEPTH]; // Where each open scope's allocations begin
+int arenaDepth = 0;
+
+// Soft heap limit: when an allocation would take the heaps past it, duManagedMalloc collects first and then
+// tells the pressure callbacks if that wasn't enough. Between collections usage is estimated from the stats.
+typedef struct pressureHandler {
+    duPressureCallback callback; // 0 while the slot is unused
+    void* context;
+} pressureHandler;
+
+long long heapLimit = 0; // 0 for no limit
+long long pressureThreshold = 0; // Estimated usage at which the limit is next enforced
+long long usedAtCollection = 0; // heapUsedBytes() when last measured
+unsigned long long reservedAtCollection = 0; // stats.bytesReserved and bytesFreed then
+unsigned long long freedAtCollection = 0;
+int notifyingPressure = 0; // Callbacks are running; what they do doesn't set them off again
+pressureHandler pressureHandlers[MAX_PRESSURE_CALLBACKS];
+
 void duManagedInitMalloc(int searchType);
 void** duManagedMalloc(int size);
+void** managedMalloc(int size, int lifetime, void* caller);
 void duManagedFree(void** mptr);
 void duMemoryDump(void);
 
 void duInitMalloc(int searchType);
 void* duMalloc(int size);
 void duFree(void* ptr);
+void insertFreeBlock(int listIndex, memoryBlockHeader* block);
 
 void printAllBlocks(int currentHeap);
 void printHeapGraphic(int currentHeap);
 void printFreeList(int currentHeap);
 void printManagedList();
 
-void minorCollection();
+int minorCollection();
 void majorCollection();
 void* duMallocOnHeap(int size, int heapIndex);
 
+int heapIndexOf(void* ptr);
+int isReferenced(memoryBlockHeader* header);
+int isYoungBlock(memoryBlockHeader* header);
+int isPinned(memoryBlockHeader* header);
+void clearWeakHandles(int oldGeneration);
+int orderSurvivors();
+int compareSurvivorSites(const void* a, const void* b);
+int compareSurvivorStamps(const void* a, const void* b);
+void directMark();
+void directFixup();
+void directScanStack() __attribute__((noinline));
+void directCollect(unsigned char* start, unsigned char* end);
+void directReach(int slot, int fromStack);
+int directStackTarget(void* word);
+int directFieldTarget(void* word);
+void findStackBase();
+int tenuredSpanIndex(int heapIndex, void* ptr);
+int addTenuredSpan(int heapIndex, unsigned char* start, unsigned char* end);
+void releaseTenuredSpan(int heapIndex, int span);
+void promoteRegionInPlace(int heapIndex, int region, memoryBlockHeader** cursor);
+void tenureBlockInPlace(int heapIndex, memoryBlockHeader* header);
+unsigned char* nextNurseryFit(int heapIndex, unsigned char* destPtr, int totalSize, memoryBlockHeader* lastCopied, memoryBlockHeader** freeTail);
+void addNurseryGap(int heapIndex, unsigned char* start, unsigned char* end, memoryBlockHeader* lastCopied, memoryBlockHeader** freeTail);
+
+void* plabAllocate(int size, int wantedBytes);
+int plabRefill(int minBytes, int wantedBytes);
+void plabRetire();
+
+void duSetOldGenMode(int mode);
+int oldGenFragmentation();
+void markOldGeneration();
+int isMarked(memoryBlockHeader* header);
+int lazySweep(int maxBlocks);
+void endSweepRun(unsigned char* runEnd);
+void markOldBlocks(int summarize);
+unsigned char* compactOldGeneration();
+int planCompactChunks(compactChunk* chunks);
+void compactChunkRun(compactChunk* chunk);
+void* compactChunkThread(void* chunk);
+void addCompactionGap(compactChunk* chunk, unsigned char* start, unsigned char* end);
+
+void noteBlockStart(void* header);
+void forgetBlockStarts(unsigned char* start, unsigned char* end);
+void rebuildBlockStarts();
+int nextSetGranule(unsigned long long* bits, int from);
+unsigned char* nextOldBlock(unsigned char* block);
+unsigned char* nextMarkedBlock(unsigned char* from);
+
+void duSetLargeBlockRemap(int enabled);
+int remapBlock(unsigned char* dest, unsigned char* src, int totalSize);
+void mergeRemappedHeap(unsigned char* end);
+
+void recordAllocation(int requested, memoryBlockHeader* block);
+void markHeapDirty(int heapIndex, unsigned char* end);
+long long imageHeapOffset();
+void* imageRebase(void* ptr, long long savedBase);
+long long nowNs();
+void recordPause(duPauseHistogram* histogram, long long startNs);
+int pauseBucket(unsigned long long ns);
+void traceRecord(const char* name, char phase, long long arg);
+void profileSample(int managedIndex, int size, void* caller) __attribute__((noinline));
+void profilePromoted(int managedIndex);
+void profileFreed(int managedIndex);
+long long profileNextSample();
+int profileFindSite(void** stack, int depth);
+pretenureSite* pretenureFind(void* caller, int add);
+int shouldPretenure(void* caller);
+void recordingWrite(int op, long long first, long long second);
+void recordingWriteNumber(unsigned long long value);
+void snapshotBlocks(FILE* out, int format, int heapIndex, unsigned char* start, unsigned char* end, int* first);
+void snapshotRecord(FILE* out, int kind, int heapIndex, int offset, int size, int managedIndex, int flags);
+void summarizeFreeList(int listIndex, unsigned long long* blocks, unsigned long long* bytes, unsigned long long* largest, int* fragmentation);
+long long heapUsedBytes();
+long long estimatedUsedBytes();
+void measureHeapUse();
+void enforceHeapLimit(int size);
+void notifyPressure(int level, long long usedBytes);
+long long cgroupMemoryLimit();
+#ifdef DU_X86_KERNELS
+void zeroSse2(unsigned char* dest, long bytes);
+void zeroAvx2(unsigned char* dest, long bytes);
+void zeroAvx512(unsigned char* dest, long bytes);
+void copySse2(unsigned char* dest, const unsigned char* src, long bytes);
+void copyAvx2(unsigned char* dest, const unsigned char* src, long bytes);
+void copyAvx512(unsigned char* dest, const unsigned char* src, long bytes);
+#endif
+
 void duManagedInitMalloc(int searchType)
 {
+    if (recordingOut != 0)
+    {
+        recordingWrite(DU_RECORD_INIT, searchType, -1);
+    }
+
     duInitMalloc(searchType); // Initialize the heap
 
     for (int i = 0; i < MAX_MANAGED; i++)
     {
         managedList[i] = 0; // Initialize the managed list
+        managedPinCount[i] = 0;
+        managedWeak[i] = 0;
+        allocationSite[i] = PRETENURE_SITES;
+        duAccessStamp[i] = 0;
+        directPointerWords[i] = -1;
     }
 
+    managedListSize = 0;
+    freeHandleCount = 0;
+    handleScopeDepth = 0;
+    weakClearedCount = 0;
+    directLive = 0;
+
+    arenaTop = arena;
+    arenaDepth = 0;
+
+    // Samples and sites of a previous run refer to handles that no longer exist
+    memset(profileSites, 0, sizeof(profileSites));
+    memset(pretenureSites, 0, sizeof(pretenureSites));
+
+    for (int i = 0; i < MAX_MANAGED; i++)
+    {
+        profileSiteOf[i] = -1;
+    }
+
+    profileBytesUntilSample = profileNextSample();
+
+    if (heapLimit > 0)
+    {
+        measureHeapUse(); // The stats the estimate builds on were just reset
+    }
 }
 void** duManagedMalloc(int size)
 {
-    void* ptr = duMalloc(size); // Allocate memory using the standard malloc
+    return managedMalloc(size, DU_LIFETIME_UNKNOWN, __builtin_return_address(0));
+}
+
+void** duManagedMallocHint(int size, int lifetime)
+{
+    return managedMalloc(size, lifetime, __builtin_return_address(0));
+}
+
+void** managedMalloc(int size, int lifetime, void* caller)
+{
+    if (heapLimit > 0 && estimatedUsedBytes() + size + (long long)sizeof(memoryBlockHeader) > pressureThreshold)
+    {
+        enforceHeapLimit(size); // Before picking a slot, as callbacks may free handles
+    }
+
+    // Reuse a released slot if there is one; inside a handle scope new handles go on top so closing it drops them
+    int index = (freeHandleCount > 0 && handleScopeDepth == 0) ? freeHandles[freeHandleCount - 1] : managedListSize;
+    void* ptr = 0;
+    int pretenured = 0;
+
+    if (index < MAX_MANAGED) // Unless the managed list is full
+    {
+        // Objects expected to live long skip the nursery; they go there anyway if the old generation has no room
+        if (lifetime == DU_LIFETIME_LONG || (lifetime == DU_LIFETIME_UNKNOWN && autoPretenure && shouldPretenure(caller)))
+        {
+            ptr = duMallocOnHeap(size, 2);
+            pretenured = (ptr != 0);
+        }
+
+        if (ptr == 0)
+        {
+            ptr = duMalloc(size); // Allocate memory using the standard malloc
+        }
+    }
+
+    if (recordingOut != 0)
+    {
+        recordingWrite(pretenured ? DU_RECORD_MALLOC_OLD : DU_RECORD_MALLOC, size, (ptr == 0) ? 0 : index + 1);
+    }
 
     if (ptr == 0)
     {
+        notifyPressure(DU_PRESSURE_CRITICAL, estimatedUsedBytes());
         return 0; // Allocation failed
     }
 
-    managedList[managedListSize] = ptr; // Store the pointer in the managed list
+    if (index == managedListSize)
+    {
+        managedListSize++;
+    }
+    else
+    {
+        freeHandleCount--;
+    }
+
+    managedList[index] = ptr; // Store the pointer in the managed list
+    managedWeak[index] = 0; // A slot a scope dropped may still carry the last handle's state
+    managedPinCount[index] = 0;
+    directPointerWords[index] = -1;
+    profileSiteOf[index] = -1;
     memoryBlockHeader* header = (memoryBlockHeader*)((unsigned char*)ptr - sizeof(memoryBlockHeader)); // Get the header of the allocated block
-    header->managedIndex = managedListSize; // Store the index in the header
+    header->managedIndex = index; // Store the index in the header
+
+    if (copyOrder == DU_COPY_ORDER_SITE)
+    {
+        pretenureSite* site = pretenureFind(caller, 1);
+        allocationSite[index] = (site != 0) ? site - pretenureSites : PRETENURE_SITES;
+    }
+    else if (copyOrder == DU_COPY_ORDER_ACCESS)
+    {
+        duAccessStamp[index] = ++duAccessClock; // Allocating counts as a touch
+    }
+
+    if (pretenured)
+    {
+        header->survivalCount = SURVIVAL_COUNT;
+        stats.allocations++;
+        stats.bytesRequested += size;
+        stats.bytesReserved += header->size + sizeof(memoryBlockHeader);
+        stats.pretenuredBytes += header->size + sizeof(memoryBlockHeader);
+    }
 
-    void** managedPtr = &managedList[managedListSize]; // Create a pointer to the managed list entry
+    void** managedPtr = &managedList[index]; // Create a pointer to the managed list entry
+
+    if (profileSampleRate != 0)
+    {
+        profileBytesUntilSample -= header->size + sizeof(memoryBlockHeader);
+
+        if (profileBytesUntilSample < 0)
+        {
+            profileSample(index, header->size + sizeof(memoryBlockHeader), caller);
 
-    managedListSize++;
+            if (pretenured)
+            {
+                profilePromoted(index); // It is old already, which keeps its site pretenured
+            }
+        }
+    }
 
     return managedPtr; // Return the pointer to the managed list entry
 
@@ -80,9 +598,38 @@ void** duManagedMalloc(int size)
 }
 void duManagedFree(void** mptr)
 {
-    duFree(*mptr); // Free the memory using the standard free
+    if (*mptr == 0 && !managedWeak[mptr - managedList])
+    {
+        return; // Already free, and the slot may already be waiting in freeHandles
+    }
+
+    if (recordingOut != 0 && *mptr != 0) // A cleared weak handle was recorded as freed when it was cleared
+    {
+        recordingWrite(DU_RECORD_FREE, mptr - managedList, -1);
+    }
+
+    profileFreed(mptr - managedList);
+
+    managedPinCount[mptr - managedList] = 0; // Pins die with the block
+    managedWeak[mptr - managedList] = 0;
+
+    if (directPointerWords[mptr - managedList] >= 0)
+    {
+        directPointerWords[mptr - managedList] = -1;
+        directLive--;
+    }
+
+    if (*mptr != 0) // A collection may have cleared a weak handle already
+    {
+        duFree(*mptr); // Free the memory using the standard free
+    }
     *mptr = 0; // Set the pointer to null
 
+    if (recycleHandles && freeHandleCount < MAX_MANAGED)
+    {
+        freeHandles[freeHandleCount++] = mptr - managedList; // The slot can hold the next handle
+    }
+
 
 }
 
@@ -125,9 +672,9 @@ void printHeapGraphic(int currentHeap)
 
     while ((unsigned char*)current < heap[currentHeap] + HEAP_SIZE)
     {
-        int chunkSize = (sizeof(memoryBlockHeader) + current->size) / 8;
+        int chunkSize = (sizeof(memoryBlockHeader) + current->size) / (HEAP_SIZE / 128); // One character per 128th of the heap
 
-        int chunkIndex = ((unsigned char*)current - heap[currentHeap]) / 8;
+        int chunkIndex = ((unsigned char*)current - heap[currentHeap]) / (HEAP_SIZE / 128);
 
         if (current->free == 0)
         {
@@ -182,11 +729,21 @@ void duInitMalloc(int searchType)
 {
     allocationStrategy = searchType;
 
-    for (int i =0; i < HEAP_SIZE; i++) // Zeroing out the heap
+    // Forget any collector state left over from a previous run
+    tenuredCount[0] = 0;
+    tenuredCount[1] = 0;
+    sweepCursor = 0;
+    sweepRunStart = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    if (kernelLevel < 0)
     {
-        heap[currentHeap][i] = 0;
+        duSetKernelLevel(DU_KERNEL_BEST);
     }
 
+    duBulkZero(heap[currentHeap], heapDirtyBytes[currentHeap]); // Zeroing out the heap, as far as it was ever written
+    heapDirtyBytes[currentHeap] = sizeof(memoryBlockHeader);
+
     memoryBlockHeader* currentBlock = (memoryBlockHeader*)heap[currentHeap]; // The first block is at the start of the heap
 
     currentBlock->size = HEAP_SIZE - sizeof(memoryBlockHeader); // The size of the first block is the total heap size minus the header size
@@ -194,10 +751,8 @@ void duInitMalloc(int searchType)
 
     freeListHead[currentHeap] = currentBlock; // Set the free list head to the first block
 
-    for (int i = 0; i < HEAP_SIZE; i++)
-    {
-        heap[2][i] = 0; // Zeroing out the second heap
-    }
+    duBulkZero(heap[2], heapDirtyBytes[2]); // Zeroing out the second heap
+    heapDirtyBytes[2] = HEAP_SIZE; // Old-generation writes aren't tracked
 
     memoryBlockHeader* secondHeapBlock = (memoryBlockHeader*)heap[2]; // The first block is at the start of the second heap
     secondHeapBlock->size = HEAP_SIZE - sizeof(memoryBlockHeader); // The size of the first block is the total heap size minus the header size
@@ -207,6 +762,12 @@ void duInitMalloc(int searchType)
     secondHeapBlock->survivalCount = 0; // Set the survival count to 0
 
     freeListHead[2] = secondHeapBlock; // Set the free list head to the first block of the second heap
+
+    if (sideMetadata)
+    {
+        memset(blockStartBits, 0, sizeof(blockStartBits));
+        noteBlockStart(secondHeapBlock);
+    }
 }
 
 void duMemoryDump()
@@ -228,6 +789,8 @@ void duMemoryDump()
 
 void* duMalloc(int size)
 {
+    int requested = size;
+
     // Ensure size is a multiple of 8 (alignment requirement)
     if (size % 8 != 0)
     {
@@ -239,7 +802,7 @@ void* duMalloc(int size)
     // -------------------------
     // FIRST FIT Allocation
     // -------------------------
-    if (allocationStrategy == FIRST_FIT)
+    if (ALLOCATION_STRATEGY == FIRST_FIT)
     {
         memoryBlockHeader* current = freeListHead[currentHeap];
         memoryBlockHeader* prev = 0;
@@ -252,8 +815,8 @@ void* duMalloc(int size)
                 void* userBlock = (unsigned char*)current + sizeof(memoryBlockHeader);
                 current->free = 0; // Mark block as used
 
-                // Exact fit — remove the block from the free list
-                if (current->size == size)
+                // Exact fit (or a remainder too small for a header) — remove the block from the free list
+                if (current->size - size < (int)sizeof(memoryBlockHeader))
                 {
                     if (current == freeListHead[currentHeap])
                     {
@@ -263,6 +826,7 @@ void* duMalloc(int size)
                     {
                         prev->next = current->next;
                     }
+                    recordAllocation(requested, current);
                     return userBlock;
                 }
 
@@ -282,6 +846,7 @@ void* duMalloc(int size)
                 }
 
                 current->size = size;
+                recordAllocation(requested, current);
                 return userBlock;
             }
 
@@ -289,6 +854,8 @@ void* duMalloc(int size)
             current = current->next;
         }
 
+        stats.allocationFailures++;
+        TRACE_EVENT("allocationFailed", 'i', size);
         return 0; // No suitable block found
     }
     // -------------------------
@@ -319,14 +886,16 @@ void* duMalloc(int size)
 
         if (best == 0)
         {
+            stats.allocationFailures++;
+            TRACE_EVENT("allocationFailed", 'i', size);
             return 0; // No suitable block found
         }
 
         void* userBlock = (unsigned char*)best + sizeof(memoryBlockHeader);
         best->free = 0; // Mark block as used
 
-        // Exact fit — remove the block from the free list
-        if (best->size == size)
+        // Exact fit (or a remainder too small for a header) — remove the block from the free list
+        if (best->size - size < (int)sizeof(memoryBlockHeader))
         {
             if (best == freeListHead[currentHeap])
             {
@@ -336,6 +905,7 @@ void* duMalloc(int size)
             {
                 bestPrev->next = best->next;
             }
+            recordAllocation(requested, best);
             return userBlock;
         }
 
@@ -355,6 +925,7 @@ void* duMalloc(int size)
         }
 
         best->size = size;
+        recordAllocation(requested, best);
         return userBlock;
     }
 }
@@ -366,139 +937,385 @@ void duFree(void* ptr)
 
     ptrHeader->free = 1;
 
-    memoryBlockHeader* current = freeListHead[currentHeap]; // Start from the head of the free list
+    stats.frees++;
+    stats.bytesFreed += ptrHeader->size + sizeof(memoryBlockHeader);
+
+    int heapIndex = heapIndexOf(ptrHeader);
+
+    if (heapIndex != 2 && tenuredSpanIndex(heapIndex, ptrHeader) >= 0)
+    {
+        return; // Promoted in place: the next majorCollection reclaims it
+    }
+
+    if (heapIndex == 2 && sweepCursor != 0 && (unsigned char*)ptrHeader >= sweepCursor)
+    {
+        // Lazy sweeping hasn't reached it yet and will pick it up; side-metadata sweeps only look at the mark
+        int granule = ((unsigned char*)ptrHeader - heap[2]) / 8;
+        markBits[granule / 64] &= ~(1ULL << (granule % 64));
+        return;
+    }
+
+    int listIndex = (heapIndex == 2) ? 2 : currentHeap; // Old blocks go back on the old generation's free list
+
+    insertFreeBlock(listIndex, ptrHeader);
+}
+
+void insertFreeBlock(int listIndex, memoryBlockHeader* block)
+{
+    memoryBlockHeader* current = freeListHead[listIndex]; // Start from the head of the free list
 
     memoryBlockHeader* prev = 0; // Previous block pointer
 
-    while (current != 0 && current < ptrHeader) // Traverse the free list to find the correct position for the freed block
+    while (current != 0 && current < block) // Traverse the free list to find the correct position for the freed block
     {
         prev = current;
         current = current->next;
     }
 
-    ptrHeader->next = current; // Link the freed block to the next block in the free list
+    block->next = current; // Link the freed block to the next block in the free list
 
     if (prev == 0) // If the freed block is the head of the free block
     {
-        freeListHead[currentHeap] = ptrHeader; // Move the head to the freed block
+        freeListHead[listIndex] = block; // Move the head to the freed block
     }
     else
     {
-        prev->next = ptrHeader; // Link the previous block to the freed block
+        prev->next = block; // Link the previous block to the freed block
     }
 
+    if (coalesceFreeBlocks)
+    {
+        // Merge with free neighbours on either side so freed memory doesn't splinter
+        if (current != 0 && (unsigned char*)block + sizeof(memoryBlockHeader) + block->size == (unsigned char*)current)
+        {
+            block->size += sizeof(memoryBlockHeader) + current->size;
+            block->next = current->next;
+            forgetBlockStarts((unsigned char*)current, (unsigned char*)current + 1);
+        }
+
+        if (prev != 0 && (unsigned char*)prev + sizeof(memoryBlockHeader) + prev->size == (unsigned char*)block)
+        {
+            prev->size += sizeof(memoryBlockHeader) + block->size;
+            prev->next = block->next;
+            forgetBlockStarts((unsigned char*)block, (unsigned char*)block + 1);
+        }
+    }
 }
 
-void minorCollection()
+int minorCollection()
 {
+    long long startNs = nowNs();
+    int status = 0;
+    TRACE_EVENT("minorCollection", 'B', -1);
+
+    if (recordingOut != 0)
+    {
+        recordingWrite(DU_RECORD_MINOR, -1, -1);
+    }
+
+    clearWeakHandles(0); // Their blocks then count as dead everywhere below
+    directMark(); // So do unreachable direct objects, and the ones the stack points at are pinned
+
     int fromHeap = currentHeap;
     int toHeap = 1 - currentHeap;
 
-    // Clear the toHeap before copying
-    for (int i = 0; i < HEAP_SIZE; i++)
+    // Measure how many bytes survive in each region of the from-space
+    int liveBytes = 0;
+    int promoteBytes = 0; // Bytes that reach SURVIVAL_COUNT this time
+
+    for (int r = 0; r < NURSERY_REGION_COUNT; r++)
+    {
+        regionLiveBytes[r] = 0;
+    }
+
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (managedList[i] != NULL)
+        {
+            memoryBlockHeader* header = (memoryBlockHeader*)((unsigned char*)managedList[i] - sizeof(memoryBlockHeader));
+
+            if (isYoungBlock(header))
+            {
+                int totalSize = header->size + sizeof(memoryBlockHeader);
+                regionLiveBytes[((unsigned char*)header - heap[fromHeap]) / NURSERY_REGION_SIZE] += totalSize;
+                liveBytes += totalSize;
+
+                if (header->survivalCount + 1 >= SURVIVAL_COUNT)
+                {
+                    promoteBytes += totalSize;
+                }
+            }
+        }
+    }
+
+    // When most of the nursery survives, hand its densest regions to the old generation as they are
+    if ((long long)liveBytes * 100 >= (long long)HEAP_SIZE * NURSERY_PROMOTE_PERCENT)
+    {
+        TRACE_EVENT("promoteRegions", 'B', liveBytes);
+
+        memoryBlockHeader* regionCursor = (memoryBlockHeader*)heap[fromHeap]; // Regions are visited in address order
+
+        for (int r = 0; r < NURSERY_REGION_COUNT; r++)
+        {
+            if (regionLiveBytes[r] * 100 >= NURSERY_REGION_SIZE * REGION_PROMOTE_PERCENT)
+            {
+                promoteRegionInPlace(fromHeap, r, &regionCursor);
+            }
+        }
+
+        TRACE_EVENT("promoteRegions", 'E', -1);
+    }
+
+    // Clear the toHeap before copying, leaving its promoted spans alone, and past the last byte it was written up to
+    unsigned char* clearPtr = heap[toHeap];
+    unsigned char* dirtyEnd = heap[toHeap] + heapDirtyBytes[toHeap];
+
+    for (int s = 0; s <= tenuredCount[toHeap]; s++)
     {
-        heap[toHeap][i] = 0;
+        unsigned char* clearEnd = (s < tenuredCount[toHeap]) ? tenuredStart[toHeap][s] : heap[toHeap] + HEAP_SIZE;
+
+        if (clearEnd > dirtyEnd)
+        {
+            clearEnd = dirtyEnd;
+        }
+
+        if (clearEnd > clearPtr)
+        {
+            duBulkZero(clearPtr, clearEnd - clearPtr);
+        }
+
+        if (s < tenuredCount[toHeap])
+        {
+            clearPtr = tenuredEnd[toHeap][s];
+        }
     }
 
+    // Only the spans are left dirty; copying below raises the mark again
+    heapDirtyBytes[toHeap] = (tenuredCount[toHeap] > 0) ? tenuredEnd[toHeap][tenuredCount[toHeap] - 1] - heap[toHeap] : 0;
+
     unsigned char* destPtr = heap[toHeap];
+    memoryBlockHeader* lastCopied = NULL; // Last block copied into toHeap
+    memoryBlockHeader* freeTail = NULL; // Last block on toHeap's new free list
 
-    for (int i = 0; i < managedListSize; i++)
+    freeListHead[toHeap] = NULL;
+
+    int copyCount = (copyOrder == DU_COPY_ORDER_INDEX) ? managedListSize : orderSurvivors();
+
+    for (int n = 0; n < copyCount; n++)
     {
+        int i = (copyOrder == DU_COPY_ORDER_INDEX) ? n : survivorOrder[n];
+
         if (managedList[i] != NULL)
         {
             memoryBlockHeader* oldHeader = (memoryBlockHeader*)((unsigned char*)managedList[i] - sizeof(memoryBlockHeader));
 
             // Only relocate if the block is from the young generation
-            if ((unsigned char*)oldHeader >= heap[fromHeap] && (unsigned char*)oldHeader < heap[fromHeap] + HEAP_SIZE)
+            if (isYoungBlock(oldHeader))
             {
                 oldHeader->survivalCount++;
 
+                if (managedPinCount[i] > 0)
+                {
+                    // Someone holds its raw address, so it becomes old where it stands
+                    tenureBlockInPlace(fromHeap, oldHeader);
+                    continue;
+                }
+
                 // 🚀 Promote to old generation if survival threshold is reached
                 if (oldHeader->survivalCount >= SURVIVAL_COUNT)
                 {
-                    void* promoted = duMallocOnHeap(oldHeader->size, 2);
+                    TRACE_EVENT("promote", 'B', oldHeader->size);
+
+                    void* promoted = plabAllocate(oldHeader->size, promoteBytes);
                     if (promoted == NULL)
                     {
-                        printf("Promotion failed for managedList[%d]\n", i);
-                        exit(1);
+                        // heap[2] is full, so the block stays where it is as part of the old generation
+                        tenureBlockInPlace(fromHeap, oldHeader);
+                        status = -1;
+
+                        TRACE_EVENT("promote", 'E', -1);
+                        continue;
                     }
 
+                    promoteBytes -= oldHeader->size + sizeof(memoryBlockHeader);
+                    stats.promotedBytes += oldHeader->size + sizeof(memoryBlockHeader);
+                    profilePromoted(oldHeader->managedIndex);
+
                     memoryBlockHeader* newHeader = (memoryBlockHeader*)((unsigned char*)promoted - sizeof(memoryBlockHeader));
                     newHeader->managedIndex = oldHeader->managedIndex;
                     newHeader->survivalCount = oldHeader->survivalCount;
-                    memcpy(newHeader + 1, oldHeader + 1, oldHeader->size);
+                    duBulkCopy(newHeader + 1, oldHeader + 1, oldHeader->size);
 
                     managedList[i] = (unsigned char*)newHeader + sizeof(memoryBlockHeader);
+
+                    TRACE_EVENT("promote", 'E', -1);
                 }
                 else
                 {
-                    // Copy to toHeap (young generation)
+                    // Copy to toHeap (young generation), stepping over its promoted spans
                     int totalSize = oldHeader->size + sizeof(memoryBlockHeader);
-                    memcpy(destPtr, oldHeader, totalSize);
+                    destPtr = nextNurseryFit(toHeap, destPtr, totalSize, lastCopied, &freeTail);
+
+                    if (destPtr + totalSize > heap[toHeap] + HEAP_SIZE)
+                    {
+                        // Spans left no room in toHeap, so the block is promoted where it stands
+                        tenureBlockInPlace(fromHeap, oldHeader);
+                        continue;
+                    }
+
+                    duBulkCopy(destPtr, oldHeader, totalSize);
 
                     memoryBlockHeader* newHeader = (memoryBlockHeader*)destPtr;
                     newHeader->next = NULL;
 
                     managedList[i] = destPtr + sizeof(memoryBlockHeader);
                     destPtr += totalSize;
+                    lastCopied = newHeader;
+                    stats.survivorBytes += totalSize;
                 }
             }
         }
     }
 
-    // Add a free block if space remains in toHeap
-    int remainingSize = (heap[toHeap] + HEAP_SIZE) - destPtr;
-
-    if (remainingSize > sizeof(memoryBlockHeader))
+    // Turn the space left between and after the promoted spans into free blocks
+    for (int s = 0; s < tenuredCount[toHeap]; s++)
     {
-        memoryBlockHeader* newFree = (memoryBlockHeader*)destPtr;
-        newFree->size = remainingSize - sizeof(memoryBlockHeader);
-        newFree->next = NULL;
-        newFree->free = 1;
-        newFree->managedIndex = -1;
-        newFree->survivalCount = 0;
+        if (tenuredEnd[toHeap][s] > destPtr)
+        {
+            addNurseryGap(toHeap, destPtr, tenuredStart[toHeap][s], lastCopied, &freeTail);
+            destPtr = tenuredEnd[toHeap][s];
+        }
+    }
+
+    markHeapDirty(toHeap, destPtr + sizeof(memoryBlockHeader)); // The last gap's header
+    addNurseryGap(toHeap, destPtr, heap[toHeap] + HEAP_SIZE, lastCopied, &freeTail);
 
-        freeListHead[toHeap] = newFree;
+    plabRetire(); // Hand the unused end of the promotion buffer back to heap[2]
+
+    currentHeap = toHeap; // Switch to the new heap
+    directFixup();
+
+    TRACE_EVENT("minorCollection", 'E', -1);
+    recordPause(&stats.minorPauses, startNs);
+
+    if (heapLimit > 0)
+    {
+        measureHeapUse();
     }
-    else
+
+    if (status != 0)
     {
-        freeListHead[toHeap] = NULL;
+        notifyPressure(DU_PRESSURE_CRITICAL, heapUsedBytes()); // Only a major collection makes room in heap[2] again
     }
 
-    currentHeap = toHeap; // Switch to the new heap
+    return status;
 }
 
 void majorCollection() {
+    long long startNs = nowNs();
+    TRACE_EVENT("majorCollection", 'B', -1);
+
+    if (recordingOut != 0)
+    {
+        recordingWrite(DU_RECORD_MAJOR, -1, -1);
+    }
+
+    clearWeakHandles(1);
+    directMark();
+
     int oldHeap = 2; // Old generation heap index
     unsigned char* heapStart = heap[oldHeap];
     unsigned char* heapEnd = heap[oldHeap] + HEAP_SIZE;
 
-    memoryBlockHeader* src = (memoryBlockHeader*)heapStart;  // Scans the heap
-    unsigned char* destPtr = heapStart;                      // Compaction destination
+    if (oldGenMode == OLD_GEN_MARK_SWEEP)
+    {
+        // Finish the last cycle's sweep so the free list reflects the whole heap
+        while (lazySweep(SWEEP_BATCH))
+        {
+        }
+
+        if (oldGenFragmentation() < COMPACT_FRAGMENTATION_PERCENT)
+        {
+            markOldGeneration();
+
+            // Nothing moves: the free list is rebuilt a batch at a time as allocation needs space
+            freeListHead[oldHeap] = 0;
+            sweepCursor = heapStart;
+            sweepRunStart = 0;
+            directFixup(); // Only unpins
+
+            TRACE_EVENT("majorCollection", 'E', -1);
+            recordPause(&stats.majorPauses, startNs);
+
+            if (heapLimit > 0)
+            {
+                measureHeapUse();
+            }
+            return;
+        }
+    }
+
+    sweepCursor = 0; // Compaction rebuilds the whole free list itself
+    sweepRunStart = 0;
 
     // Reset free list for old heap
     freeListHead[oldHeap] = 0;
 
-    while ((unsigned char*)src < heapEnd) {
-        int totalSize = sizeof(memoryBlockHeader) + src->size;
+    if (sideMetadata) {
+        memset(blockStartBits, 0, sizeof(blockStartBits)); // Every start is noted again below
+    }
 
-        if (src->free == 0) {
-            if ((unsigned char*)src != destPtr) {
-                // Move block forward
-                memcpy(destPtr, src, totalSize);
+    unsigned char* destPtr = compactOldGeneration();
 
-                memoryBlockHeader* newHeader = (memoryBlockHeader*)destPtr;
+    // Move blocks that were promoted in place into the old heap while there is room
+    for (int h = 0; h < 2; h++)
+    {
+        for (int s = tenuredCount[h] - 1; s >= 0; s--)
+        {
+            int stillUsed = 0;
+            memoryBlockHeader* block = (memoryBlockHeader*)tenuredStart[h][s];
 
-                // Update managed pointer to new location
-                if (newHeader->managedIndex >= 0 && newHeader->managedIndex < MAX_MANAGED) {
-                    managedList[newHeader->managedIndex] = (unsigned char*)newHeader + sizeof(memoryBlockHeader);
+            while ((unsigned char*)block < tenuredEnd[h][s])
+            {
+                int totalSize = sizeof(memoryBlockHeader) + block->size;
+
+                if (block->free == 0 && isReferenced(block))
+                {
+                    // Leave either nothing or room for a free block header behind it
+                    if (isPinned(block))
+                    {
+                        stillUsed = 1;
+                    }
+                    else if (destPtr + totalSize == heapEnd || destPtr + totalSize + sizeof(memoryBlockHeader) <= heapEnd)
+                    {
+                        duBulkCopy(destPtr, block, totalSize);
+
+                        memoryBlockHeader* newHeader = (memoryBlockHeader*)destPtr;
+                        newHeader->next = 0;
+                        managedList[newHeader->managedIndex] = (unsigned char*)newHeader + sizeof(memoryBlockHeader);
+                        noteBlockStart(newHeader);
+
+                        block->free = 1;
+                        destPtr += totalSize;
+                    }
+                    else
+                    {
+                        stillUsed = 1;
+                    }
+                }
+                else
+                {
+                    block->free = 1;
                 }
+
+                block = (memoryBlockHeader*)((unsigned char*)block + totalSize);
             }
-            destPtr += totalSize;
-        }
 
-        // Move to the next block
-        src = (memoryBlockHeader*)((unsigned char*)src + totalSize);
+            if (!stillUsed)
+            {
+                releaseTenuredSpan(h, s);
+            }
+        }
     }
 
     // Add one large free block with the remaining space
@@ -510,14 +1327,23 @@ void majorCollection() {
         freeBlock->free = 1;
         freeBlock->managedIndex = -1;
 
-        freeListHead[oldHeap] = freeBlock;
-    } else {
-        // No space left for even a free block
-        freeListHead[oldHeap] = 0;
+        insertFreeBlock(oldHeap, freeBlock); // Behind any padding left in front of remapped blocks
+        noteBlockStart(freeBlock);
     }
-}
 
-void* duMallocOnHeap(int size, int heapIndex) 
+    mergeRemappedHeap((remaining >= (int)sizeof(memoryBlockHeader)) ? destPtr + sizeof(memoryBlockHeader) : heapEnd);
+
+    directFixup();
+
+    TRACE_EVENT("majorCollection", 'E', -1);
+    recordPause(&stats.majorPauses, startNs);
+
+    if (heapLimit > 0) {
+        measureHeapUse();
+    }
+}
+
+void* duMallocOnHeap(int size, int heapIndex) 
 {
     // Align size to 8 bytes
     if (size % 8 != 0) 
@@ -536,57 +1362,3311 @@ void* duMallocOnHeap(int size, int heapIndex)
     unsigned char* heapStart = heap[heapIndex];
     unsigned char* heapEnd = heap[heapIndex] + HEAP_SIZE;
 
-    memoryBlockHeader* current = freeListHead[heapIndex]; // Search from the free list
-    memoryBlockHeader* prev = 0;
-
-    while ((unsigned char*)current < heapEnd && current != 0) 
+    // The old generation may still have blocks waiting to be swept, so keep sweeping until one fits
+    do
     {
-        if (current->free && current->size >= size) 
-        {
-            void* userBlock = (unsigned char*)current + sizeof(memoryBlockHeader);
-            current->free = 0;
+        memoryBlockHeader* current = freeListHead[heapIndex]; // Search from the free list
+        memoryBlockHeader* prev = 0;
 
-            // Check if we can split the block
-            if (current->size - size >= (int)sizeof(memoryBlockHeader) + 8) 
+        while ((unsigned char*)current < heapEnd && current != 0) 
+        {
+            if (current->free && current->size >= size) 
             {
-                memoryBlockHeader* newFree = (memoryBlockHeader*)((unsigned char*)current + blockSize);
-                newFree->size = current->size - blockSize;
-                newFree->next = current->next;
-                newFree->free = 1;
-                newFree->managedIndex = -1;
-                newFree->survivalCount = 0;
+                void* userBlock = (unsigned char*)current + sizeof(memoryBlockHeader);
+                current->free = 0;
 
-                if (current == freeListHead[heapIndex]) 
+                // Check if we can split the block
+                if (current->size - size >= (int)sizeof(memoryBlockHeader) + 8) 
                 {
-                    freeListHead[heapIndex] = newFree;
+                    memoryBlockHeader* newFree = (memoryBlockHeader*)((unsigned char*)current + blockSize);
+                    newFree->size = current->size - blockSize;
+                    newFree->next = current->next;
+                    newFree->free = 1;
+                    newFree->managedIndex = -1;
+                    newFree->survivalCount = 0;
+                    noteBlockStart(newFree);
+
+                    if (current == freeListHead[heapIndex]) 
+                    {
+                        freeListHead[heapIndex] = newFree;
+                    } 
+                    else if (prev != 0) 
+                    {
+                        prev->next = newFree;
+                    }
+
+                    current->size = size;
+                    current->next = 0; // It is now an allocated block
                 } 
-                else if (prev != 0) 
+                else 
                 {
-                    prev->next = newFree;
+                    // Can't split, just remove from free list
+                    if (current == freeListHead[heapIndex]) 
+                    {
+                        freeListHead[heapIndex] = current->next;
+                    } 
+                    else if (prev != 0) 
+                    {
+                        prev->next = current->next;
+                    }
                 }
 
-                current->size = size;
-                current->next = 0; // It is now an allocated block
-            } 
-            else 
+                markHeapDirty(heapIndex, (unsigned char*)current + 2 * sizeof(memoryBlockHeader) + current->size);
+                return userBlock;
+            }
+
+            prev = current;
+            current = current->next;
+        }
+    } while (heapIndex == 2 && lazySweep(SWEEP_BATCH));
+
+    return 0; // No suitable block found
+}
+
+int heapIndexOf(void* ptr)
+{
+    for (int h = 0; h < HEAP_COUNT; h++)
+    {
+        if ((unsigned char*)ptr >= heap[h] && (unsigned char*)ptr < heap[h] + HEAP_SIZE)
+        {
+            return h;
+        }
+    }
+
+    return -1; // Not inside any heap
+}
+
+int isReferenced(memoryBlockHeader* header)
+{
+    // A block is live while its managed list entry still points at it
+    return header->managedIndex >= 0 && header->managedIndex < managedListSize &&
+        managedList[header->managedIndex] == (unsigned char*)header + sizeof(memoryBlockHeader);
+}
+
+int isPinned(memoryBlockHeader* header)
+{
+    return isReferenced(header) && managedPinCount[header->managedIndex] > 0;
+}
+
+int isYoungBlock(memoryBlockHeader* header)
+{
+    return heapIndexOf(header) == currentHeap && tenuredSpanIndex(currentHeap, header) < 0;
+}
+
+int tenuredSpanIndex(int heapIndex, void* ptr)
+{
+    if (heapIndex != 0 && heapIndex != 1)
+    {
+        return -1; // Only the semispaces hold promoted spans
+    }
+
+    for (int s = 0; s < tenuredCount[heapIndex]; s++)
+    {
+        if ((unsigned char*)ptr >= tenuredStart[heapIndex][s] && (unsigned char*)ptr < tenuredEnd[heapIndex][s])
+        {
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+int addTenuredSpan(int heapIndex, unsigned char* start, unsigned char* end)
+{
+    // Spans already inside the new one, or touching it, are absorbed by it
+    int kept = 0;
+
+    for (int s = 0; s < tenuredCount[heapIndex]; s++)
+    {
+        if (tenuredEnd[heapIndex][s] == start)
+        {
+            start = tenuredStart[heapIndex][s];
+            continue;
+        }
+
+        if (tenuredStart[heapIndex][s] == end)
+        {
+            end = tenuredEnd[heapIndex][s];
+            continue;
+        }
+
+        if (tenuredStart[heapIndex][s] >= start && tenuredEnd[heapIndex][s] <= end)
+        {
+            continue;
+        }
+
+        tenuredStart[heapIndex][kept] = tenuredStart[heapIndex][s];
+        tenuredEnd[heapIndex][kept] = tenuredEnd[heapIndex][s];
+        kept++;
+    }
+
+    tenuredCount[heapIndex] = kept;
+
+    if (tenuredCount[heapIndex] == MAX_TENURED_SPANS)
+    {
+        return 0; // No room to track another span
+    }
+
+    // Insert in address order
+    int s = tenuredCount[heapIndex];
+
+    while (s > 0 && tenuredStart[heapIndex][s - 1] > start)
+    {
+        tenuredStart[heapIndex][s] = tenuredStart[heapIndex][s - 1];
+        tenuredEnd[heapIndex][s] = tenuredEnd[heapIndex][s - 1];
+        s--;
+    }
+
+    tenuredStart[heapIndex][s] = start;
+    tenuredEnd[heapIndex][s] = end;
+    tenuredCount[heapIndex]++;
+
+    return 1;
+}
+
+void releaseTenuredSpan(int heapIndex, int span)
+{
+    if (heapIndex == currentHeap)
+    {
+        // The span sits in the live nursery, so it goes back as one free block
+        memoryBlockHeader* freeBlock = (memoryBlockHeader*)tenuredStart[heapIndex][span];
+        freeBlock->size = tenuredEnd[heapIndex][span] - tenuredStart[heapIndex][span] - sizeof(memoryBlockHeader);
+        freeBlock->free = 1;
+        freeBlock->managedIndex = -1;
+        freeBlock->survivalCount = 0;
+
+        insertFreeBlock(heapIndex, freeBlock);
+    }
+
+    // The idle semispace is rebuilt by the next minorCollection, so it only needs to forget the span
+    for (int s = span; s < tenuredCount[heapIndex] - 1; s++)
+    {
+        tenuredStart[heapIndex][s] = tenuredStart[heapIndex][s + 1];
+        tenuredEnd[heapIndex][s] = tenuredEnd[heapIndex][s + 1];
+    }
+
+    tenuredCount[heapIndex]--;
+}
+
+void promoteRegionInPlace(int heapIndex, int region, memoryBlockHeader** cursor)
+{
+    unsigned char* regionStart = heap[heapIndex] + region * NURSERY_REGION_SIZE;
+    unsigned char* regionEnd = regionStart + NURSERY_REGION_SIZE;
+    unsigned char* spanStart = 0;
+    unsigned char* spanEnd = 0;
+
+    // Walk on from where the last region left off to the blocks whose headers are in this one
+    while ((unsigned char*)*cursor < regionStart)
+    {
+        *cursor = (memoryBlockHeader*)((unsigned char*)*cursor + sizeof(memoryBlockHeader) + (*cursor)->size);
+    }
+
+    // The span runs from the first to the last live young block whose header is in the region
+    for (; (unsigned char*)*cursor < regionEnd; *cursor = (memoryBlockHeader*)((unsigned char*)*cursor + sizeof(memoryBlockHeader) + (*cursor)->size))
+    {
+        memoryBlockHeader* header = *cursor;
+
+        if (header->free == 0 && isReferenced(header) && isYoungBlock(header))
+        {
+            if (spanStart == 0)
+            {
+                spanStart = (unsigned char*)header;
+            }
+
+            spanEnd = (unsigned char*)header + sizeof(memoryBlockHeader) + header->size;
+        }
+    }
+
+    if (spanStart == 0)
+    {
+        return;
+    }
+
+    int kept = 0;
+
+    for (int s = 0; s < tenuredCount[heapIndex]; s++)
+    {
+        if (tenuredStart[heapIndex][s] < spanStart || tenuredEnd[heapIndex][s] > spanEnd)
+        {
+            kept++;
+        }
+    }
+
+    if (kept == MAX_TENURED_SPANS)
+    {
+        return; // No room to track another span, so the region is copied like any other
+    }
+
+    // Every young block in the span becomes old: survivors as they are, the rest as old free space
+    memoryBlockHeader* block = (memoryBlockHeader*)spanStart;
+
+    while ((unsigned char*)block < spanEnd)
+    {
+        if (tenuredSpanIndex(heapIndex, block) < 0)
+        {
+            if (block->free == 0 && isReferenced(block))
+            {
+                block->survivalCount = SURVIVAL_COUNT;
+                stats.promotedBytes += sizeof(memoryBlockHeader) + block->size;
+                profilePromoted(block->managedIndex);
+            }
+            else
+            {
+                block->free = 1;
+            }
+        }
+
+        block = (memoryBlockHeader*)((unsigned char*)block + sizeof(memoryBlockHeader) + block->size);
+    }
+
+    addTenuredSpan(heapIndex, spanStart, spanEnd);
+}
+
+void tenureBlockInPlace(int heapIndex, memoryBlockHeader* header)
+{
+    unsigned char* spanStart = (unsigned char*)header;
+    unsigned char* spanEnd = spanStart + sizeof(memoryBlockHeader) + header->size;
+
+    if (tenuredCount[heapIndex] == MAX_TENURED_SPANS)
+    {
+        // No room for another span, so grow the closest one out to the block instead
+        int nearest = 0;
+        long nearestGap = -1;
+
+        for (int s = 0; s < tenuredCount[heapIndex]; s++)
+        {
+            long gap = (tenuredStart[heapIndex][s] >= spanEnd) ? tenuredStart[heapIndex][s] - spanEnd : spanStart - tenuredEnd[heapIndex][s];
+
+            if (nearestGap < 0 || gap < nearestGap)
+            {
+                nearest = s;
+                nearestGap = gap;
+            }
+        }
+
+        if (tenuredStart[heapIndex][nearest] < spanStart)
+        {
+            spanStart = tenuredStart[heapIndex][nearest];
+        }
+        else
+        {
+            spanEnd = tenuredEnd[heapIndex][nearest];
+        }
+    }
+
+    // Young blocks the span takes in become old like promoteRegionInPlace makes them
+    memoryBlockHeader* block = (memoryBlockHeader*)spanStart;
+
+    while ((unsigned char*)block < spanEnd)
+    {
+        if (tenuredSpanIndex(heapIndex, block) < 0)
+        {
+            if (block->free == 0 && isReferenced(block))
+            {
+                block->survivalCount = SURVIVAL_COUNT;
+                stats.promotedBytes += sizeof(memoryBlockHeader) + block->size;
+                profilePromoted(block->managedIndex);
+            }
+            else
+            {
+                block->free = 1;
+            }
+        }
+
+        block = (memoryBlockHeader*)((unsigned char*)block + sizeof(memoryBlockHeader) + block->size);
+    }
+
+    // Can't fail: with every slot taken the new span swallows the one it grew out to
+    addTenuredSpan(heapIndex, spanStart, spanEnd);
+}
+
+unsigned char* nextNurseryFit(int heapIndex, unsigned char* destPtr, int totalSize, memoryBlockHeader* lastCopied, memoryBlockHeader** freeTail)
+{
+    for (int s = 0; s < tenuredCount[heapIndex]; s++)
+    {
+        if (tenuredEnd[heapIndex][s] <= destPtr)
+        {
+            continue;
+        }
+
+        if (destPtr + totalSize <= tenuredStart[heapIndex][s])
+        {
+            break; // Fits before this span
+        }
+
+        // Doesn't fit in front of the span, so free the gap and continue past it
+        addNurseryGap(heapIndex, destPtr, tenuredStart[heapIndex][s], lastCopied, freeTail);
+        destPtr = tenuredEnd[heapIndex][s];
+    }
+
+    return destPtr;
+}
+
+void addNurseryGap(int heapIndex, unsigned char* start, unsigned char* end, memoryBlockHeader* lastCopied, memoryBlockHeader** freeTail)
+{
+    int gap = end - start;
+
+    if (gap <= 0)
+    {
+        return;
+    }
+
+    if (gap < (int)sizeof(memoryBlockHeader))
+    {
+        // Too small for a header. Gaps only shrink below a header by copying, so the block in front was just copied
+        if (lastCopied != NULL && (unsigned char*)lastCopied + sizeof(memoryBlockHeader) + lastCopied->size == start)
+        {
+            lastCopied->size += gap;
+        }
+        return;
+    }
+
+    memoryBlockHeader* newFree = (memoryBlockHeader*)start;
+    newFree->size = gap - sizeof(memoryBlockHeader);
+    newFree->next = NULL;
+    newFree->free = 1;
+    newFree->managedIndex = -1;
+    newFree->survivalCount = 0;
+
+    if (*freeTail == NULL)
+    {
+        freeListHead[heapIndex] = newFree;
+    }
+    else
+    {
+        (*freeTail)->next = newFree;
+    }
+
+    *freeTail = newFree;
+}
+
+void* plabAllocate(int size, int wantedBytes)
+{
+    int blockSize = size + sizeof(memoryBlockHeader);
+
+    // A block may end the buffer exactly, otherwise it has to leave room for a free header
+    if (plabTop == 0 || (plabTop + blockSize != plabEnd && plabTop + blockSize + sizeof(memoryBlockHeader) > plabEnd))
+    {
+        plabRetire();
+
+        if (!plabRefill(blockSize, wantedBytes))
+        {
+            return 0; // Old generation is out of room
+        }
+    }
+
+    memoryBlockHeader* header = (memoryBlockHeader*)plabTop;
+    header->free = 0;
+    header->size = size;
+    header->managedIndex = -1;
+    header->survivalCount = 0;
+    header->next = 0;
+    noteBlockStart(header);
+
+    plabTop += blockSize;
+    plabLast = header;
+
+    return (unsigned char*)header + sizeof(memoryBlockHeader);
+}
+
+int plabRefill(int minBytes, int wantedBytes)
+{
+    TRACE_EVENT("plabRefill", 'i', wantedBytes);
+
+    int chunkSize = (wantedBytes > PLAB_SIZE) ? wantedBytes : PLAB_SIZE;
+
+    if (chunkSize < minBytes)
+    {
+        chunkSize = minBytes;
+    }
+
+    // Sweep more of the old generation while nothing on the free list is big enough
+    do
+    {
+        memoryBlockHeader* current = freeListHead[2];
+        memoryBlockHeader* prev = 0;
+
+        // Take the first free block that can hold the next promoted block
+        while (current != 0)
+        {
+            int available = current->size + sizeof(memoryBlockHeader);
+
+            if (available >= minBytes)
             {
-                // Can't split, just remove from free list
-                if (current == freeListHead[heapIndex]) 
+                memoryBlockHeader* rest = current->next;
+
+                // Leave what this collection won't need on the free list
+                if (available - chunkSize >= (int)sizeof(memoryBlockHeader) + 8)
                 {
-                    freeListHead[heapIndex] = current->next;
-                } 
-                else if (prev != 0) 
+                    rest = (memoryBlockHeader*)((unsigned char*)current + chunkSize);
+                    rest->size = available - chunkSize - sizeof(memoryBlockHeader);
+                    rest->next = current->next;
+                    rest->free = 1;
+                    rest->managedIndex = -1;
+                    rest->survivalCount = 0;
+                    noteBlockStart(rest);
+                    available = chunkSize;
+                }
+
+                if (prev == 0)
                 {
-                    prev->next = current->next;
+                    freeListHead[2] = rest;
                 }
+                else
+                {
+                    prev->next = rest;
+                }
+
+                plabTop = (unsigned char*)current;
+                plabEnd = plabTop + available;
+                plabLast = 0;
+
+                return 1;
             }
 
-            return userBlock;
+            prev = current;
+            current = current->next;
         }
+    } while (lazySweep(SWEEP_BATCH));
 
-        prev = current;
-        current = current->next;
+    return 0;
+}
+
+void plabRetire()
+{
+    if (plabTop == 0)
+    {
+        return;
     }
 
-    return 0; // No suitable block found
+    int leftover = plabEnd - plabTop;
+
+    if (leftover >= (int)sizeof(memoryBlockHeader))
+    {
+        memoryBlockHeader* freeBlock = (memoryBlockHeader*)plabTop;
+        freeBlock->size = leftover - sizeof(memoryBlockHeader);
+        freeBlock->free = 1;
+        freeBlock->managedIndex = -1;
+        freeBlock->survivalCount = 0;
+        noteBlockStart(freeBlock);
+
+        insertFreeBlock(2, freeBlock);
+    }
+    else if (leftover > 0 && plabLast != 0)
+    {
+        plabLast->size += leftover; // Too small for a header, so the last promoted block keeps it
+    }
+
+    plabTop = 0;
+    plabEnd = 0;
+    plabLast = 0;
+}
+
+void duSetOldGenMode(int mode)
+{
+    oldGenMode = mode;
+}
+
+int oldGenFragmentation()
+{
+    int totalFree = 0;
+    int largestFree = 0;
+
+    for (memoryBlockHeader* current = freeListHead[2]; current != 0; current = current->next)
+    {
+        int available = current->size + sizeof(memoryBlockHeader);
+
+        totalFree += available;
+
+        if (available > largestFree)
+        {
+            largestFree = available;
+        }
+    }
+
+    if (totalFree == 0)
+    {
+        return 0;
+    }
+
+    return 100 - (largestFree * 100) / totalFree; // Percent of free space outside the largest block
+}
+
+void markOldGeneration()
+{
+    markOldBlocks(0);
+
+    // Promoted spans don't move in this mode; their dead blocks are freed and empty spans go back to the nursery
+    for (int h = 0; h < 2; h++)
+    {
+        for (int s = tenuredCount[h] - 1; s >= 0; s--)
+        {
+            int stillUsed = 0;
+            memoryBlockHeader* block = (memoryBlockHeader*)tenuredStart[h][s];
+
+            while ((unsigned char*)block < tenuredEnd[h][s])
+            {
+                if (block->free == 0 && isReferenced(block))
+                {
+                    stillUsed = 1;
+                }
+                else
+                {
+                    block->free = 1;
+                }
+
+                block = (memoryBlockHeader*)((unsigned char*)block + sizeof(memoryBlockHeader) + block->size);
+            }
+
+            if (!stillUsed)
+            {
+                releaseTenuredSpan(h, s);
+            }
+        }
+    }
+}
+
+void markOldBlocks(int summarize)
+{
+    memset(markBits, 0, sizeof(markBits));
+
+    if (summarize)
+    {
+        memset(compactRegionLive, 0, sizeof(compactRegionLive));
+        memset(compactRegionEnd, 0, sizeof(compactRegionEnd));
+    }
+
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (managedList[i] != NULL)
+        {
+            memoryBlockHeader* header = (memoryBlockHeader*)((unsigned char*)managedList[i] - sizeof(memoryBlockHeader));
+
+            if (heapIndexOf(header) == 2 && isReferenced(header))
+            {
+                int granule = ((unsigned char*)header - heap[2]) / 8;
+                markBits[granule / 64] |= 1ULL << (granule % 64);
+
+                if (summarize)
+                {
+                    // The header has just been read, so summing here saves parallel compaction a pass over the blocks
+                    int region = ((unsigned char*)header - heap[2]) / COMPACT_REGION_SIZE;
+                    unsigned char* end = (unsigned char*)header + sizeof(memoryBlockHeader) + header->size;
+
+                    compactRegionLive[region] += end - (unsigned char*)header;
+                    if (end > compactRegionEnd[region])
+                    {
+                        compactRegionEnd[region] = end;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int isMarked(memoryBlockHeader* header)
+{
+    int granule = ((unsigned char*)header - heap[2]) / 8;
+
+    return (markBits[granule / 64] >> (granule % 64)) & 1;
+}
+
+int lazySweep(int maxBlocks)
+{
+    if (sweepCursor == 0)
+    {
+        return 0; // Nothing left to sweep
+    }
+
+    unsigned char* heapEnd = heap[2] + HEAP_SIZE;
+
+    TRACE_EVENT("lazySweep", 'B', -1);
+
+    for (int swept = 0; swept < maxBlocks && sweepCursor < heapEnd; swept++)
+    {
+        memoryBlockHeader* block = (memoryBlockHeader*)sweepCursor;
+
+        if (sideMetadata)
+        {
+            // Everything up to the next marked block is dead, so the whole stretch is one step and none of it is read
+            if (isMarked(block))
+            {
+                if (sweepRunStart != 0)
+                {
+                    endSweepRun(sweepCursor);
+                }
+
+                sweepCursor = nextOldBlock(sweepCursor);
+            }
+            else
+            {
+                if (sweepRunStart == 0)
+                {
+                    sweepRunStart = sweepCursor;
+                }
+
+                sweepCursor = nextMarkedBlock(sweepCursor + 8);
+            }
+            continue;
+        }
+
+        if (block->free == 1 || !isMarked(block))
+        {
+            // Dead or already free: gather it into the current run
+            if (sweepRunStart == 0)
+            {
+                sweepRunStart = sweepCursor;
+            }
+        }
+        else if (sweepRunStart != 0)
+        {
+            endSweepRun(sweepCursor);
+        }
+
+        sweepCursor += sizeof(memoryBlockHeader) + block->size;
+    }
+
+    if (sweepCursor >= heapEnd)
+    {
+        if (sweepRunStart != 0)
+        {
+            endSweepRun(heapEnd);
+        }
+
+        sweepCursor = 0;
+    }
+
+    TRACE_EVENT("lazySweep", 'E', -1);
+
+    return 1;
+}
+
+void endSweepRun(unsigned char* runEnd)
+{
+    // Coalesce the run of dead blocks into one free block
+    memoryBlockHeader* freeBlock = (memoryBlockHeader*)sweepRunStart;
+    freeBlock->size = runEnd - sweepRunStart - sizeof(memoryBlockHeader);
+    freeBlock->free = 1;
+    freeBlock->managedIndex = -1;
+    freeBlock->survivalCount = 0;
+
+    forgetBlockStarts(sweepRunStart + 8, runEnd); // The run's blocks are one block now
+    sweepRunStart = 0;
+
+    insertFreeBlock(2, freeBlock);
+}
+
+void duSetLargeBlockRemap(int enabled)
+{
+    largeBlockRemap = enabled;
+}
+
+int remapBlock(unsigned char* dest, unsigned char* src, int totalSize)
+{
+#ifdef DU_HOSTED
+    // Only whole pages inside the block can be remapped; the partial pages at either end are copied
+    unsigned char* srcPages = src + (REMAP_PAGE_SIZE - (unsigned long)src % REMAP_PAGE_SIZE) % REMAP_PAGE_SIZE;
+    unsigned char* srcPagesEnd = src + totalSize - (unsigned long)(src + totalSize) % REMAP_PAGE_SIZE;
+    long distance = src - dest; // A multiple of the page size
+    long pageBytes = srcPagesEnd - srcPages;
+
+    if (srcPagesEnd <= srcPages || distance % REMAP_PAGE_SIZE != 0)
+    {
+        return 0;
+    }
+
+    // Each move can split off the pages it moved, the hole they left and the pieces around both
+    if (__atomic_add_fetch(&remapMappings, 4, __ATOMIC_RELAXED) > REMAP_MAX_MAPPINGS)
+    {
+        return 0; // Copy until mergeRemappedHeap gets heap[2] back to one mapping
+    }
+
+    TRACE_EVENT("remapBlock", 'i', totalSize);
+
+    memmove(dest, src, srcPages - src); // Head: lands below src, since distance is at least a page
+
+    if (distance >= pageBytes)
+    {
+        if (mremap(srcPages, pageBytes, pageBytes, MREMAP_MAYMOVE | MREMAP_FIXED, srcPages - distance) == MAP_FAILED)
+        {
+            memmove(srcPages - distance, srcPages, src + totalSize - srcPages);
+            return 1;
+        }
+    }
+    else
+    {
+        // mremap can't move pages onto their own source, so overlapping moves go through a scratch reservation
+        void* scratch = mmap(0, pageBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (scratch == MAP_FAILED ||
+            mremap(srcPages, pageBytes, pageBytes, MREMAP_MAYMOVE | MREMAP_FIXED, scratch) == MAP_FAILED)
+        {
+            if (scratch != MAP_FAILED)
+            {
+                munmap(scratch, pageBytes);
+            }
+
+            memmove(srcPages - distance, srcPages, src + totalSize - srcPages);
+            return 1;
+        }
+
+        if (mremap(scratch, pageBytes, pageBytes, MREMAP_MAYMOVE | MREMAP_FIXED, srcPages - distance) == MAP_FAILED)
+        {
+            // Put the pages back where they came from and copy instead
+            mremap(scratch, pageBytes, pageBytes, MREMAP_MAYMOVE | MREMAP_FIXED, srcPages);
+            memmove(srcPages - distance, srcPages, src + totalSize - srcPages);
+            return 1;
+        }
+    }
+
+    // The pages the block moved out of (and didn't move into) are left unmapped, so map fresh ones back
+    unsigned char* hole = (srcPagesEnd - distance > srcPages) ? srcPagesEnd - distance : srcPages;
+    mmap(hole, srcPagesEnd - hole, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+    memmove(srcPagesEnd - distance, srcPagesEnd, src + totalSize - srcPagesEnd); // Tail
+
+    return 1;
+#else
+    (void)dest;
+    (void)src;
+    (void)totalSize;
+    return 0; // No page remapping here, so the caller copies
+#endif
+}
+
+void mergeRemappedHeap(unsigned char* end)
+{
+#ifdef DU_HOSTED
+    // Half the budget leaves room for the next compaction's remaps before it has to copy
+    if (remapMappings < REMAP_MAX_MAPPINGS / 2)
+    {
+        return;
+    }
+
+    // Only the whole pages of heap[2] are replaced; past the last one the page is shared with other data
+    long mappedBytes = HEAP_SIZE - HEAP_SIZE % REMAP_PAGE_SIZE;
+    long liveBytes = end - heap[2];
+
+    liveBytes += (REMAP_PAGE_SIZE - liveBytes % REMAP_PAGE_SIZE) % REMAP_PAGE_SIZE;
+    liveBytes = (liveBytes < mappedBytes) ? liveBytes : mappedBytes;
+
+    // Copy what is in use into one fresh mapping and move it over all the pieces at once; the rest stays untouched zeros
+    void* fresh = mmap(0, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (fresh == MAP_FAILED)
+    {
+        return; // Remapping stays off once the budget is spent, and the next compaction tries again
+    }
+
+    TRACE_EVENT("mergeRemappedHeap", 'i', liveBytes);
+    duBulkCopy(fresh, heap[2], liveBytes);
+
+    if (mremap(fresh, mappedBytes, mappedBytes, MREMAP_MAYMOVE | MREMAP_FIXED, heap[2]) == MAP_FAILED)
+    {
+        munmap(fresh, mappedBytes);
+        return;
+    }
+
+    remapMappings = 0;
+#else
+    (void)end;
+#endif
+}
+
+void duGetStats(duStats* out)
+{
+    *out = stats;
+
+    summarizeFreeList(currentHeap, &out->nurseryFreeBlocks, &out->nurseryFreeBytes, &out->nurseryLargestFree, &out->nurseryFragmentation);
+
+    // Blocks lazy sweeping hasn't reached yet aren't on the free list, so they aren't counted
+    summarizeFreeList(2, &out->oldFreeBlocks, &out->oldFreeBytes, &out->oldLargestFree, &out->oldFragmentation);
+
+    out->usedBytes = heapUsedBytes();
+}
+
+unsigned long long duPauseBucketStart(int bucket)
+{
+    if (bucket < 2 * DU_PAUSE_SUB_BUCKETS)
+    {
+        return bucket; // One nanosecond per bucket at the bottom
+    }
+
+    int exponent = 4 + (bucket - 2 * DU_PAUSE_SUB_BUCKETS) / DU_PAUSE_SUB_BUCKETS;
+    int subBucket = (bucket - 2 * DU_PAUSE_SUB_BUCKETS) % DU_PAUSE_SUB_BUCKETS;
+
+    return (unsigned long long)(DU_PAUSE_SUB_BUCKETS + subBucket) << (exponent - 3);
+}
+
+unsigned long long duPausePercentile(const duPauseHistogram* histogram, double percentile)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+
+    // Rank of the pause we are after, counting from 1
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * histogram->count + 0.999999);
+
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    unsigned long long seen = 0;
+
+    for (int b = 0; b < DU_PAUSE_BUCKETS; b++)
+    {
+        seen += histogram->buckets[b];
+
+        if (seen >= rank)
+        {
+            // Report the top of the bucket, but never more than the longest pause actually seen
+            unsigned long long top = (b + 1 < DU_PAUSE_BUCKETS) ? duPauseBucketStart(b + 1) - 1 : histogram->maxNs;
+
+            return (top < histogram->maxNs) ? top : histogram->maxNs;
+        }
+    }
+
+    return histogram->maxNs;
+}
+
+void recordAllocation(int requested, memoryBlockHeader* block)
+{
+    stats.allocations++;
+    stats.bytesRequested += requested;
+    stats.bytesReserved += block->size + sizeof(memoryBlockHeader);
+
+    // Everything duMalloc hands out passes through here; count the header a split leaves behind the block too
+    markHeapDirty(currentHeap, (unsigned char*)block + 2 * sizeof(memoryBlockHeader) + block->size);
+}
+
+void markHeapDirty(int heapIndex, unsigned char* end)
+{
+    // Chunks added with duAddHeapChunk lie outside the heap; ones above it just mark the whole heap
+    long dirty = end - heap[heapIndex];
+
+    if (dirty > heapDirtyBytes[heapIndex])
+    {
+        heapDirtyBytes[heapIndex] = (dirty < HEAP_SIZE) ? dirty : HEAP_SIZE;
+    }
+}
+
+long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void recordPause(duPauseHistogram* histogram, long long startNs)
+{
+    long long elapsed = nowNs() - startNs;
+    unsigned long long ns = (elapsed > 0) ? (unsigned long long)elapsed : 0;
+
+    histogram->count++;
+    histogram->totalNs += ns;
+
+    if (ns > histogram->maxNs)
+    {
+        histogram->maxNs = ns;
+    }
+
+    histogram->buckets[pauseBucket(ns)]++;
+}
+
+int pauseBucket(unsigned long long ns)
+{
+    if (ns < 2 * DU_PAUSE_SUB_BUCKETS)
+    {
+        return (int)ns;
+    }
+
+    int exponent = 63 - __builtin_clzll(ns); // Position of the top bit, at least 4 here
+    int subBucket = (ns >> (exponent - 3)) & (DU_PAUSE_SUB_BUCKETS - 1); // The three bits below it
+    int bucket = 2 * DU_PAUSE_SUB_BUCKETS + (exponent - 4) * DU_PAUSE_SUB_BUCKETS + subBucket;
+
+    return (bucket < DU_PAUSE_BUCKETS) ? bucket : DU_PAUSE_BUCKETS - 1;
+}
+
+void summarizeFreeList(int listIndex, unsigned long long* blocks, unsigned long long* bytes, unsigned long long* largest, int* fragmentation)
+{
+    *blocks = 0;
+    *bytes = 0;
+    *largest = 0;
+
+    for (memoryBlockHeader* current = freeListHead[listIndex]; current != 0; current = current->next)
+    {
+        unsigned long long available = current->size + sizeof(memoryBlockHeader);
+
+        (*blocks)++;
+        *bytes += available;
+
+        if (available > *largest)
+        {
+            *largest = available;
+        }
+    }
+
+    *fragmentation = (*bytes == 0) ? 0 : (int)(100 - (*largest * 100) / *bytes);
+}
+
+void duTraceEnable(int enabled)
+{
+    traceEnabled = enabled;
+}
+
+int duTraceWrite(FILE* out)
+{
+    int count = __atomic_load_n(&traceRingCount, __ATOMIC_ACQUIRE);
+    int first = 1;
+
+    if (count > TRACE_MAX_THREADS)
+    {
+        count = TRACE_MAX_THREADS;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (int t = 0; t < count; t++)
+    {
+        traceRing* ring = &traceRings[t];
+
+        // Oldest surviving event first
+        unsigned long long end = ring->written;
+        unsigned long long start = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+
+        for (unsigned long long e = start; e < end; e++)
+        {
+            traceEvent* event = &ring->events[e % TRACE_RING_SIZE];
+
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"%c\",\"ts\":%lld.%03lld,\"pid\":1,\"tid\":%d",
+                first ? "" : ",", event->name, event->phase, event->ts / 1000, event->ts % 1000, t + 1);
+
+            if (event->phase == 'i')
+            {
+                fprintf(out, ",\"s\":\"t\""); // Instant events are scoped to their thread
+            }
+
+            if (event->arg >= 0)
+            {
+                fprintf(out, ",\"args\":{\"bytes\":%lld}", event->arg);
+            }
+
+            fprintf(out, "}");
+            first = 0;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+
+    return ferror(out) ? -1 : 0;
+}
+
+void traceRecord(const char* name, char phase, long long arg)
+{
+    traceRing* ring = threadTraceRing;
+
+    if (ring == 0)
+    {
+        int index = __atomic_fetch_add(&traceRingCount, 1, __ATOMIC_ACQ_REL);
+
+        if (index >= TRACE_MAX_THREADS)
+        {
+            return; // Every ring is taken, so this thread goes untraced
+        }
+
+        ring = &traceRings[index];
+        threadTraceRing = ring;
+    }
+
+    traceEvent* event = &ring->events[ring->written % TRACE_RING_SIZE];
+    event->name = name;
+    event->phase = phase;
+    event->ts = nowNs();
+    event->arg = arg;
+
+    ring->written++;
+}
+
+void duProfileSetSampleRate(long long bytes)
+{
+    profileSampleRate = (bytes > 0) ? bytes : 0;
+    profileBytesUntilSample = profileNextSample();
+}
+
+int duProfileWrite(FILE* out, int profile)
+{
+    long long totalInUseObjects = 0;
+    long long totalInUseBytes = 0;
+    long long totalAllocObjects = 0;
+    long long totalAllocBytes = 0;
+
+    // The promoted profile reports promotions in the in-use columns, so pprof shows them by default
+    for (int s = 0; s < PROFILE_MAX_SITES; s++)
+    {
+        profileSite* site = &profileSites[s];
+
+        if (site->depth > 0)
+        {
+            totalInUseObjects += (profile == DU_PROFILE_PROMOTED) ? site->promotedObjects : site->liveObjects;
+            totalInUseBytes += (profile == DU_PROFILE_PROMOTED) ? site->promotedBytes : site->liveBytes;
+            totalAllocObjects += site->allocObjects;
+            totalAllocBytes += site->allocBytes;
+        }
+    }
+
+    // Legacy pprof heap format; heap_v2 tells pprof how to scale the samples back up
+    fprintf(out, "heap profile: %lld: %lld [%lld: %lld] @ heap_v2/%lld\n",
+        totalInUseObjects, totalInUseBytes, totalAllocObjects, totalAllocBytes, profileSampleRate);
+
+    for (int s = 0; s < PROFILE_MAX_SITES; s++)
+    {
+        profileSite* site = &profileSites[s];
+
+        if (site->depth == 0)
+        {
+            continue;
+        }
+
+        fprintf(out, "%lld: %lld [%lld: %lld] @",
+            (profile == DU_PROFILE_PROMOTED) ? site->promotedObjects : site->liveObjects,
+            (profile == DU_PROFILE_PROMOTED) ? site->promotedBytes : site->liveBytes,
+            site->allocObjects, site->allocBytes);
+
+        for (int f = 0; f < site->depth; f++)
+        {
+            fprintf(out, " %p", site->stack[f]);
+        }
+
+        fprintf(out, "\n");
+    }
+
+    // pprof needs the mappings to turn addresses into symbols
+    FILE* maps = fopen("/proc/self/maps", "r");
+
+    if (maps != 0)
+    {
+        char line[512];
+
+        fprintf(out, "\nMAPPED_LIBRARIES:\n");
+
+        while (fgets(line, sizeof(line), maps) != 0)
+        {
+            fputs(line, out);
+        }
+
+        fclose(maps);
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+void profileSample(int managedIndex, int size, void* caller)
+{
+    // Sample points are a Poisson process over allocated bytes, which is what heap_v2 scaling assumes
+    while (profileBytesUntilSample < 0)
+    {
+        profileBytesUntilSample += profileNextSample();
+    }
+
+    void* stack[PROFILE_MAX_DEPTH + 3];
+    int skip = 0;
+#ifdef DU_HOSTED
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 3);
+
+    // Leave out the allocator's own frames; the caller's frame is where they end
+    skip = (depth > 2) ? 2 : depth;
+
+    for (int f = 0; f < depth && f < 4; f++)
+    {
+        if (stack[f] == caller)
+        {
+            skip = f;
+            break;
+        }
+    }
+
+    depth -= skip;
+
+    if (depth > PROFILE_MAX_DEPTH)
+    {
+        depth = PROFILE_MAX_DEPTH;
+    }
+#else
+    stack[0] = caller; // Without backtrace only the caller is known
+    int depth = 1;
+#endif
+
+    if (depth <= 0)
+    {
+        return;
+    }
+
+    int s = profileFindSite(stack + skip, depth);
+
+    if (s < 0)
+    {
+        return; // Site table full
+    }
+
+    profileSites[s].allocObjects++;
+    profileSites[s].allocBytes += size;
+    profileSites[s].liveObjects++;
+    profileSites[s].liveBytes += size;
+
+    profileSiteOf[managedIndex] = s;
+    profileSizeOf[managedIndex] = size;
+
+    pretenureSite* pretenure = pretenureFind(stack[skip], 1);
+
+    if (pretenure != 0 && ++pretenure->samples >= PRETENURE_DECAY_SAMPLES)
+    {
+        pretenure->samples /= 2;
+        pretenure->promoted /= 2;
+    }
+}
+
+void profilePromoted(int managedIndex)
+{
+    if (managedIndex < 0 || managedIndex >= MAX_MANAGED || profileSiteOf[managedIndex] < 0)
+    {
+        return;
+    }
+
+    profileSite* site = &profileSites[profileSiteOf[managedIndex]];
+    site->promotedObjects++;
+    site->promotedBytes += profileSizeOf[managedIndex];
+
+    pretenureSite* pretenure = pretenureFind(site->stack[0], 0);
+
+    if (pretenure != 0 && pretenure->promoted < pretenure->samples)
+    {
+        pretenure->promoted++;
+    }
+}
+
+void profileFreed(int managedIndex)
+{
+    if (managedIndex < 0 || managedIndex >= MAX_MANAGED || profileSiteOf[managedIndex] < 0)
+    {
+        return;
+    }
+
+    profileSite* site = &profileSites[profileSiteOf[managedIndex]];
+    site->liveObjects--;
+    site->liveBytes -= profileSizeOf[managedIndex];
+
+    profileSiteOf[managedIndex] = -1;
+}
+
+long long profileNextSample()
+{
+    if (profileSampleRate == 0)
+    {
+        return 0;
+    }
+
+    profileRandom ^= profileRandom << 13;
+    profileRandom ^= profileRandom >> 7;
+    profileRandom ^= profileRandom << 17;
+
+    double u = ((profileRandom >> 11) + 1) * (1.0 / 9007199254740992.0); // Uniform in (0, 1]
+
+    // ln(u) without libm: split off the binary exponent, then a short atanh series for the mantissa in [1, 2)
+    union { double d; unsigned long long bits; } value = { u };
+    int exponent = (int)((value.bits >> 52) & 0x7ff) - 1023;
+    value.bits = (value.bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+
+    double t = (value.d - 1) / (value.d + 1);
+    double t2 = t * t;
+    double logU = exponent * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+
+    return (long long)(-logU * profileSampleRate) + 1; // Exponentially distributed gap with mean profileSampleRate
+}
+
+int profileFindSite(void** stack, int depth)
+{
+    if (depth > PROFILE_MAX_DEPTH)
+    {
+        depth = PROFILE_MAX_DEPTH;
+    }
+
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (int f = 0; f < depth; f++)
+    {
+        hash = (hash ^ (unsigned long long)stack[f]) * 1099511628211ULL;
+    }
+
+    // Open addressing: the first slot that is empty or holds the same stack
+    for (int probe = 0; probe < PROFILE_MAX_SITES; probe++)
+    {
+        int s = (hash + probe) % PROFILE_MAX_SITES;
+        profileSite* site = &profileSites[s];
+
+        if (site->depth == 0)
+        {
+            site->depth = depth;
+            memcpy(site->stack, stack, depth * sizeof(void*));
+            return s;
+        }
+
+        if (site->depth == depth && memcmp(site->stack, stack, depth * sizeof(void*)) == 0)
+        {
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+int duHeapSnapshot(FILE* out, int format)
+{
+    if (format == DU_SNAPSHOT_JSON)
+    {
+        fprintf(out, "{\"version\":%d,\"heapSize\":%d,\"heapCount\":%d,\"currentHeap\":%d,\"heaps\":[",
+            DU_SNAPSHOT_VERSION, HEAP_SIZE, HEAP_COUNT, currentHeap);
+    }
+    else
+    {
+        snapshotRecord(out, DU_SNAPSHOT_MAGIC, HEAP_COUNT, currentHeap, HEAP_SIZE, managedListSize, DU_SNAPSHOT_VERSION);
+    }
+
+    for (int h = 0; h < HEAP_COUNT; h++)
+    {
+        int first = 1;
+
+        if (format == DU_SNAPSHOT_JSON)
+        {
+            fprintf(out, "%s\n{\"index\":%d,\"blocks\":[", (h == 0) ? "" : ",", h);
+        }
+
+        if (h == currentHeap || h == 2)
+        {
+            snapshotBlocks(out, format, h, heap[h], heap[h] + HEAP_SIZE, &first);
+        }
+        else
+        {
+            // Outside its promoted spans the idle semispace only holds what the last copy left behind
+            for (int s = 0; s < tenuredCount[h]; s++)
+            {
+                snapshotBlocks(out, format, h, tenuredStart[h][s], tenuredEnd[h][s], &first);
+            }
+        }
+
+        if (format == DU_SNAPSHOT_JSON)
+        {
+            fprintf(out, "],\"freeList\":[");
+        }
+
+        first = 1;
+
+        // The idle semispace's free list is stale until the next minorCollection rebuilds it
+        for (memoryBlockHeader* current = (h == currentHeap || h == 2) ? freeListHead[h] : 0; current != 0; current = current->next)
+        {
+            int offset = (unsigned char*)current - heap[h];
+
+            if (format == DU_SNAPSHOT_JSON)
+            {
+                fprintf(out, "%s[%d,%d]", first ? "" : ",", offset, current->size);
+            }
+            else
+            {
+                snapshotRecord(out, DU_SNAPSHOT_FREE_ENTRY, h, offset, current->size, -1, 0);
+            }
+
+            first = 0;
+        }
+
+        if (format == DU_SNAPSHOT_JSON)
+        {
+            fprintf(out, "]}");
+        }
+    }
+
+    if (format == DU_SNAPSHOT_JSON)
+    {
+        fprintf(out, "],\n\"handles\":[");
+    }
+
+    for (int i = 0; i < managedListSize; i++)
+    {
+        int heapIndex = -1;
+        int offset = 0;
+        int size = 0;
+
+        if (managedList[i] != NULL)
+        {
+            memoryBlockHeader* header = (memoryBlockHeader*)((unsigned char*)managedList[i] - sizeof(memoryBlockHeader));
+            heapIndex = heapIndexOf(header);
+            offset = (unsigned char*)header - heap[heapIndex];
+            size = header->size;
+        }
+
+        if (format == DU_SNAPSHOT_JSON)
+        {
+            if (heapIndex < 0)
+            {
+                fprintf(out, "%snull", (i == 0) ? "" : ",");
+            }
+            else
+            {
+                fprintf(out, "%s[%d,%d,%d]", (i == 0) ? "" : ",", heapIndex, offset, size);
+            }
+        }
+        else
+        {
+            snapshotRecord(out, DU_SNAPSHOT_HANDLE, heapIndex, offset, size, i, 0);
+        }
+    }
+
+    if (format == DU_SNAPSHOT_JSON)
+    {
+        fprintf(out, "]}\n");
+    }
+    else
+    {
+        snapshotRecord(out, DU_SNAPSHOT_END, 0, 0, 0, 0, 0);
+    }
+
+    fflush(out);
+
+    return ferror(out) ? -1 : 0;
+}
+
+void snapshotBlocks(FILE* out, int format, int heapIndex, unsigned char* start, unsigned char* end, int* first)
+{
+    memoryBlockHeader* block = (memoryBlockHeader*)start;
+
+    while ((unsigned char*)block < end)
+    {
+        int offset = (unsigned char*)block - heap[heapIndex];
+        int flags = block->survivalCount << DU_SNAPSHOT_SURVIVAL_SHIFT;
+
+        if (block->free)
+        {
+            flags |= DU_SNAPSHOT_FREE;
+        }
+
+        if (block->free == 0 && isReferenced(block))
+        {
+            flags |= DU_SNAPSHOT_REFERENCED;
+        }
+
+        if (tenuredSpanIndex(heapIndex, block) >= 0)
+        {
+            flags |= DU_SNAPSHOT_TENURED;
+        }
+
+        if (block->free == 0 && isPinned(block))
+        {
+            flags |= DU_SNAPSHOT_PINNED;
+        }
+
+        if (block->free == 0 && isReferenced(block) && managedWeak[block->managedIndex])
+        {
+            flags |= DU_SNAPSHOT_WEAK;
+        }
+
+        if (format == DU_SNAPSHOT_JSON)
+        {
+            // [offset, size, flags, managedIndex] keeps big heaps' snapshots small
+            fprintf(out, "%s[%d,%d,%d,%d]", *first ? "" : ",", offset, block->size, flags, block->managedIndex);
+        }
+        else
+        {
+            snapshotRecord(out, DU_SNAPSHOT_BLOCK, heapIndex, offset, block->size, block->managedIndex, flags);
+        }
+
+        *first = 0;
+        block = (memoryBlockHeader*)((unsigned char*)block + sizeof(memoryBlockHeader) + block->size);
+    }
+}
+
+void snapshotRecord(FILE* out, int kind, int heapIndex, int offset, int size, int managedIndex, int flags)
+{
+    duSnapshotRecord record;
+    record.kind = kind;
+    record.heap = heapIndex;
+    record.offset = offset;
+    record.size = size;
+    record.managedIndex = managedIndex;
+    record.flags = flags;
+
+    fwrite(&record, sizeof(record), 1, out);
+}
+
+int duHeapSnapshotAsync(const char* path, int format, duSnapshotCallback done, void* context)
+{
+#ifdef DU_HOSTED
+    int slot = -1;
+
+    for (int i = 0; i < MAX_ASYNC_SNAPSHOTS; i++)
+    {
+        if (asyncSnapshots[i].pid == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0)
+    {
+        return -1; // Too many dumps running already
+    }
+
+    int fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        return -1;
+    }
+
+    fflush(0); // Otherwise the child would write out the parent's buffered output too
+
+    int pid = fork();
+
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        // The child sees the heap frozen at the fork, while the parent's writes go to copied pages
+        close(fds[0]);
+
+        FILE* out = fopen(path, "wb");
+        char status = (out != 0 && duHeapSnapshot(out, format) == 0) ? 0 : 1;
+
+        if (out != 0 && fclose(out) != 0)
+        {
+            status = 1;
+        }
+
+        if (write(fds[1], &status, 1) != 1)
+        {
+            status = 1;
+        }
+
+        _exit(status); // Skip atexit handlers and stdio buffers that belong to the parent
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    asyncSnapshots[slot].pid = pid;
+    asyncSnapshots[slot].readFd = fds[0];
+    asyncSnapshots[slot].done = done;
+    asyncSnapshots[slot].context = context;
+
+    return fds[0];
+#else
+    (void)path;
+    (void)format;
+    (void)done;
+    (void)context;
+    return -1; // No fork here
+#endif
+}
+
+int duHeapSnapshotPoll(int wait)
+{
+    int running = 0;
+
+#ifdef DU_HOSTED
+    for (int i = 0; i < MAX_ASYNC_SNAPSHOTS; i++)
+    {
+        asyncSnapshot* dump = &asyncSnapshots[i];
+        int status;
+
+        if (dump->pid == 0)
+        {
+            continue;
+        }
+
+        int reaped = waitpid(dump->pid, &status, wait ? 0 : WNOHANG);
+
+        if (reaped == 0)
+        {
+            running++;
+            continue;
+        }
+
+        int result = (reaped == dump->pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+
+        close(dump->readFd);
+        dump->pid = 0;
+
+        if (dump->done != 0)
+        {
+            dump->done(result, dump->context);
+        }
+    }
+#else
+    (void)wait; // Nothing was forked, so there is nothing to reap
+#endif
+
+    return running;
+}
+
+void duRecordingStart(FILE* out)
+{
+    recordingOut = out;
+
+    // The header says how the recording run was configured; replay can override it
+    fwrite(DU_RECORD_MAGIC, 1, 4, recordingOut);
+    recordingWriteNumber(HEAP_SIZE);
+    recordingWriteNumber(ALLOCATION_STRATEGY);
+    recordingWriteNumber(oldGenMode);
+    recordingWriteNumber(managedListSize); // Handles below this were allocated before recording started
+}
+
+void duRecordingStop()
+{
+    if (recordingOut != 0)
+    {
+        recordingWrite(DU_RECORD_END, -1, -1);
+        fflush(recordingOut);
+    }
+
+    recordingOut = 0;
+}
+
+void recordingWrite(int op, long long first, long long second)
+{
+    putc(op, recordingOut);
+
+    if (first >= 0)
+    {
+        recordingWriteNumber(first);
+    }
+
+    if (second >= 0)
+    {
+        recordingWriteNumber(second);
+    }
+}
+
+void recordingWriteNumber(unsigned long long value)
+{
+    // Seven bits per byte, high bit set on all but the last, so small sizes and handles take one or two bytes
+    while (value >= 0x80)
+    {
+        putc((int)(value & 0x7f) | 0x80, recordingOut);
+        value >>= 7;
+    }
+
+    putc((int)value, recordingOut);
+}
+
+void* duMallocAligned(int size, int alignment)
+{
+    if (alignment <= 8)
+    {
+        return duMalloc(size); // Payloads are always 8-byte aligned
+    }
+
+    // Room for the payload at any alignment, plus a free block in front of it
+    unsigned char* ptr = duMalloc(size + alignment + 2 * sizeof(memoryBlockHeader));
+
+    if (ptr == 0 || (unsigned long)ptr % alignment == 0)
+    {
+        return ptr;
+    }
+
+    memoryBlockHeader* header = (memoryBlockHeader*)(ptr - sizeof(memoryBlockHeader));
+    unsigned char* end = ptr + header->size;
+
+    // The first aligned payload with room for a block header in front of it
+    unsigned char* aligned = (unsigned char*)(((unsigned long)ptr + sizeof(memoryBlockHeader) + alignment - 1) & ~(unsigned long)(alignment - 1));
+
+    memoryBlockHeader* alignedHeader = (memoryBlockHeader*)(aligned - sizeof(memoryBlockHeader));
+    alignedHeader->free = 0;
+    alignedHeader->size = end - aligned;
+    alignedHeader->managedIndex = -1;
+    alignedHeader->survivalCount = 0;
+    alignedHeader->next = 0;
+
+    // What is left in front goes back on the free list
+    header->size = (unsigned char*)alignedHeader - ptr;
+    duFree(ptr);
+
+    return aligned;
+}
+
+int duUsableSize(void* ptr)
+{
+    return ((memoryBlockHeader*)((unsigned char*)ptr - sizeof(memoryBlockHeader)))->size;
+}
+
+void duAddHeapChunk(void* memory, int size)
+{
+    // The chunk becomes one free block on the nursery's free list, so duMalloc can carve from it
+    memoryBlockHeader* block = (memoryBlockHeader*)memory;
+    block->size = size - sizeof(memoryBlockHeader);
+    block->free = 1;
+    block->managedIndex = -1;
+    block->survivalCount = 0;
+
+    insertFreeBlock(currentHeap, block);
+}
+
+void duSetCoalescing(int enabled)
+{
+    coalesceFreeBlocks = enabled;
+}
+
+void* duPin(void** mptr)
+{
+    managedPinCount[mptr - managedList]++;
+    return *mptr;
+}
+
+void duUnpin(void** mptr)
+{
+    int index = mptr - managedList;
+
+    if (managedPinCount[index] > 0)
+    {
+        managedPinCount[index]--;
+    }
+}
+
+int duArenaBegin()
+{
+    if (arenaDepth == MAX_ARENA_DEPTH)
+    {
+        return -1;
+    }
+
+    arenaScopeStart[arenaDepth] = arenaTop;
+    return arenaDepth++;
+}
+
+void duArenaEnd()
+{
+    if (arenaDepth > 0)
+    {
+        arenaTop = arenaScopeStart[--arenaDepth];
+    }
+}
+
+void* duArenaMalloc(int size)
+{
+    // Each object keeps its size in the 8 bytes in front of it so duArenaEscape knows how much to copy
+    int blockSize = 8 + ((size + 7) & ~7);
+
+    if (arenaDepth == 0 || size < 0 || blockSize > arena + ARENA_SIZE - arenaTop)
+    {
+        return 0;
+    }
+
+    *(int*)arenaTop = size;
+    void* ptr = arenaTop + 8;
+    arenaTop += blockSize;
+
+    return ptr;
+}
+
+void** duArenaEscape(void* ptr)
+{
+    // The copy is an ordinary managed block, so it outlives every scope
+    int size = *(int*)((unsigned char*)ptr - 8);
+    void** mptr = duManagedMalloc(size);
+
+    if (mptr != 0)
+    {
+        memcpy(*mptr, ptr, size);
+    }
+
+    return mptr;
+}
+
+void duSetHandleRecycling(int enabled)
+{
+    recycleHandles = enabled;
+
+    if (!enabled)
+    {
+        freeHandleCount = 0;
+    }
+}
+
+void duHandleScopeOpen(duHandleScope* scope)
+{
+    // Reserve a slot below the scope for the handle it may escape
+    scope->escapeSlot = -1;
+
+    if (managedListSize < MAX_MANAGED)
+    {
+        scope->escapeSlot = managedListSize;
+        managedList[managedListSize++] = 0;
+    }
+
+    scope->watermark = managedListSize;
+    handleScopeDepth++;
+}
+
+void duHandleScopeClose(duHandleScope* scope)
+{
+    for (int i = scope->watermark; i < managedListSize; i++)
+    {
+        if (managedList[i] != 0)
+        {
+            duManagedFree(&managedList[i]);
+        }
+        else
+        {
+            managedWeak[i] = 0; // Cleared by a collection, so duManagedFree isn't coming for it
+        }
+    }
+
+    // An unused escape slot goes too, as long as nothing was escaped into it
+    managedListSize = (scope->escapeSlot >= 0 && managedList[scope->escapeSlot] == 0) ? scope->escapeSlot : scope->watermark;
+
+    // Released slots past the new end no longer exist
+    int kept = 0;
+
+    for (int i = 0; i < freeHandleCount; i++)
+    {
+        if (freeHandles[i] < managedListSize)
+        {
+            freeHandles[kept++] = freeHandles[i];
+        }
+    }
+
+    freeHandleCount = kept;
+    handleScopeDepth--;
+}
+
+void** duHandleScopeEscape(duHandleScope* scope, void** mptr)
+{
+    int from = mptr - managedList;
+    int to = scope->escapeSlot;
+
+    if (to < 0 || managedList[to] != 0 || *mptr == 0)
+    {
+        return 0; // Only one handle can escape each scope
+    }
+
+    if (recordingOut != 0)
+    {
+        recordingWrite(DU_RECORD_MOVE, from, to);
+    }
+
+    // The block keeps its place; only its handle moves to the reserved slot
+    managedList[to] = *mptr;
+    ((memoryBlockHeader*)((unsigned char*)managedList[to] - sizeof(memoryBlockHeader)))->managedIndex = to;
+    managedPinCount[to] = managedPinCount[from];
+    managedWeak[to] = managedWeak[from];
+    allocationSite[to] = allocationSite[from];
+    duAccessStamp[to] = duAccessStamp[from];
+    directPointerWords[to] = directPointerWords[from];
+    profileSiteOf[to] = profileSiteOf[from];
+    profileSizeOf[to] = profileSizeOf[from];
+
+    managedList[from] = 0;
+    managedPinCount[from] = 0;
+    managedWeak[from] = 0;
+    directPointerWords[from] = -1;
+    profileSiteOf[from] = -1;
+
+    return &managedList[to];
+}
+
+int duSetKernelLevel(int level)
+{
+    // Fall back level by level to what this CPU can run
+    kernelLevel = DU_KERNEL_SCALAR;
+    zeroKernel = 0;
+    copyKernel = 0;
+
+#ifdef DU_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (level >= DU_KERNEL_AVX512 && __builtin_cpu_supports("avx512f"))
+    {
+        kernelLevel = DU_KERNEL_AVX512;
+        zeroKernel = zeroAvx512;
+        copyKernel = copyAvx512;
+    }
+    else if (level >= DU_KERNEL_AVX2 && __builtin_cpu_supports("avx2"))
+    {
+        kernelLevel = DU_KERNEL_AVX2;
+        zeroKernel = zeroAvx2;
+        copyKernel = copyAvx2;
+    }
+    else if (level >= DU_KERNEL_SSE2 && __builtin_cpu_supports("sse2"))
+    {
+        kernelLevel = DU_KERNEL_SSE2;
+        zeroKernel = zeroSse2;
+        copyKernel = copySse2;
+    }
+#endif
+
+    return kernelLevel;
+}
+
+void duBulkZero(void* dest, long bytes)
+{
+    if (bytes < KERNEL_MIN_BYTES || zeroKernel == 0)
+    {
+        memset(dest, 0, bytes);
+        return;
+    }
+
+    zeroKernel(dest, bytes);
+}
+
+void duBulkCopy(void* dest, const void* src, long bytes)
+{
+    if (bytes < KERNEL_MIN_BYTES || copyKernel == 0)
+    {
+        memcpy(dest, src, bytes);
+        return;
+    }
+
+    copyKernel(dest, src, bytes);
+}
+
+#ifdef DU_X86_KERNELS
+// Each kernel stores up to a vector boundary of dest, runs whole unrolled vectors, then finishes the tail.
+// Ranges of STREAM_THRESHOLD or more use non-temporal stores, fenced so later loads see them.
+
+__attribute__((target("sse2"))) void zeroSse2(unsigned char* dest, long bytes)
+{
+    long head = (16 - (unsigned long)dest % 16) % 16;
+    memset(dest, 0, head);
+    dest += head;
+    bytes -= head;
+
+    __m128i zero = _mm_setzero_si128();
+    long body = bytes & ~63L;
+
+    if (bytes >= STREAM_THRESHOLD)
+    {
+        for (long i = 0; i < body; i += 64)
+        {
+            _mm_stream_si128((__m128i*)(dest + i), zero);
+            _mm_stream_si128((__m128i*)(dest + i + 16), zero);
+            _mm_stream_si128((__m128i*)(dest + i + 32), zero);
+            _mm_stream_si128((__m128i*)(dest + i + 48), zero);
+        }
+        _mm_sfence();
+    }
+    else
+    {
+        for (long i = 0; i < body; i += 64)
+        {
+            _mm_store_si128((__m128i*)(dest + i), zero);
+            _mm_store_si128((__m128i*)(dest + i + 16), zero);
+            _mm_store_si128((__m128i*)(dest + i + 32), zero);
+            _mm_store_si128((__m128i*)(dest + i + 48), zero);
+        }
+    }
+
+    memset(dest + body, 0, bytes - body);
+}
+
+__attribute__((target("avx2"))) void zeroAvx2(unsigned char* dest, long bytes)
+{
+    long head = (32 - (unsigned long)dest % 32) % 32;
+    memset(dest, 0, head);
+    dest += head;
+    bytes -= head;
+
+    __m256i zero = _mm256_setzero_si256();
+    long body = bytes & ~127L;
+
+    if (bytes >= STREAM_THRESHOLD)
+    {
+        for (long i = 0; i < body; i += 128)
+        {
+            _mm256_stream_si256((__m256i*)(dest + i), zero);
+            _mm256_stream_si256((__m256i*)(dest + i + 32), zero);
+            _mm256_stream_si256((__m256i*)(dest + i + 64), zero);
+            _mm256_stream_si256((__m256i*)(dest + i + 96), zero);
+        }
+        _mm_sfence();
+    }
+    else
+    {
+        for (long i = 0; i < body; i += 128)
+        {
+            _mm256_store_si256((__m256i*)(dest + i), zero);
+            _mm256_store_si256((__m256i*)(dest + i + 32), zero);
+            _mm256_store_si256((__m256i*)(dest + i + 64), zero);
+            _mm256_store_si256((__m256i*)(dest + i + 96), zero);
+        }
+    }
+
+    memset(dest + body, 0, bytes - body);
+}
+
+__attribute__((target("avx512f"))) void zeroAvx512(unsigned char* dest, long bytes)
+{
+    long head = (64 - (unsigned long)dest % 64) % 64;
+    memset(dest, 0, head);
+    dest += head;
+    bytes -= head;
+
+    __m512i zero = _mm512_setzero_si512();
+    long body = bytes & ~255L;
+
+    if (bytes >= STREAM_THRESHOLD)
+    {
+        for (long i = 0; i < body; i += 256)
+        {
+            _mm512_stream_si512((__m512i*)(dest + i), zero);
+            _mm512_stream_si512((__m512i*)(dest + i + 64), zero);
+            _mm512_stream_si512((__m512i*)(dest + i + 128), zero);
+            _mm512_stream_si512((__m512i*)(dest + i + 192), zero);
+        }
+        _mm_sfence();
+    }
+    else
+    {
+        for (long i = 0; i < body; i += 256)
+        {
+            _mm512_store_si512((__m512i*)(dest + i), zero);
+            _mm512_store_si512((__m512i*)(dest + i + 64), zero);
+            _mm512_store_si512((__m512i*)(dest + i + 128), zero);
+            _mm512_store_si512((__m512i*)(dest + i + 192), zero);
+        }
+    }
+
+    memset(dest + body, 0, bytes - body);
+}
+
+__attribute__((target("sse2"))) void copySse2(unsigned char* dest, const unsigned char* src, long bytes)
+{
+    long head = (16 - (unsigned long)dest % 16) % 16;
+    memcpy(dest, src, head);
+    dest += head;
+    src += head;
+    bytes -= head;
+
+    long body = bytes & ~63L;
+
+    for (long i = 0; i < body; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+
+        if (bytes >= STREAM_THRESHOLD)
+        {
+            _mm_stream_si128((__m128i*)(dest + i), a);
+            _mm_stream_si128((__m128i*)(dest + i + 16), b);
+            _mm_stream_si128((__m128i*)(dest + i + 32), c);
+            _mm_stream_si128((__m128i*)(dest + i + 48), d);
+        }
+        else
+        {
+            _mm_store_si128((__m128i*)(dest + i), a);
+            _mm_store_si128((__m128i*)(dest + i + 16), b);
+            _mm_store_si128((__m128i*)(dest + i + 32), c);
+            _mm_store_si128((__m128i*)(dest + i + 48), d);
+        }
+    }
+
+    if (bytes >= STREAM_THRESHOLD)
+    {
+        _mm_sfence();
+    }
+
+    memcpy(dest + body, src + body, bytes - body);
+}
+
+__attribute__((target("avx2"))) void copyAvx2(unsigned char* dest, const unsigned char* src, long bytes)
+{
+    long head = (32 - (unsigned long)dest % 32) % 32;
+    memcpy(dest, src, head);
+    dest += head;
+    src += head;
+    bytes -= head;
+
+    long body = bytes & ~127L;
+
+    for (long i = 0; i < body; i += 128)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + i + 96));
+
+        if (bytes >= STREAM_THRESHOLD)
+        {
+            _mm256_stream_si256((__m256i*)(dest + i), a);
+            _mm256_stream_si256((__m256i*)(dest + i + 32), b);
+            _mm256_stream_si256((__m256i*)(dest + i + 64), c);
+            _mm256_stream_si256((__m256i*)(dest + i + 96), d);
+        }
+        else
+        {
+            _mm256_store_si256((__m256i*)(dest + i), a);
+            _mm256_store_si256((__m256i*)(dest + i + 32), b);
+            _mm256_store_si256((__m256i*)(dest + i + 64), c);
+            _mm256_store_si256((__m256i*)(dest + i + 96), d);
+        }
+    }
+
+    if (bytes >= STREAM_THRESHOLD)
+    {
+        _mm_sfence();
+    }
+
+    memcpy(dest + body, src + body, bytes - body);
+}
+
+__attribute__((target("avx512f"))) void copyAvx512(unsigned char* dest, const unsigned char* src, long bytes)
+{
+    long head = (64 - (unsigned long)dest % 64) % 64;
+    memcpy(dest, src, head);
+    dest += head;
+    src += head;
+    bytes -= head;
+
+    long body = bytes & ~255L;
+
+    for (long i = 0; i < body; i += 256)
+    {
+        __m512i a = _mm512_loadu_si512((const void*)(src + i));
+        __m512i b = _mm512_loadu_si512((const void*)(src + i + 64));
+        __m512i c = _mm512_loadu_si512((const void*)(src + i + 128));
+        __m512i d = _mm512_loadu_si512((const void*)(src + i + 192));
+
+        if (bytes >= STREAM_THRESHOLD)
+        {
+            _mm512_stream_si512((__m512i*)(dest + i), a);
+            _mm512_stream_si512((__m512i*)(dest + i + 64), b);
+            _mm512_stream_si512((__m512i*)(dest + i + 128), c);
+            _mm512_stream_si512((__m512i*)(dest + i + 192), d);
+        }
+        else
+        {
+            _mm512_store_si512((__m512i*)(dest + i), a);
+            _mm512_store_si512((__m512i*)(dest + i + 64), b);
+            _mm512_store_si512((__m512i*)(dest + i + 128), c);
+            _mm512_store_si512((__m512i*)(dest + i + 192), d);
+        }
+    }
+
+    if (bytes >= STREAM_THRESHOLD)
+    {
+        _mm_sfence();
+    }
+
+    memcpy(dest + body, src + body, bytes - body);
+}
+#endif
+
+int duHeapSave(const char* path)
+{
+    FILE* out = fopen(path, "wb");
+
+    if (out == 0)
+    {
+        return -1;
+    }
+
+    heapImage image;
+    memset(&image, 0, sizeof(image));
+    memcpy(image.magic, DU_HEAP_IMAGE_MAGIC, 8);
+    image.heapSize = HEAP_SIZE;
+    image.heapCount = HEAP_COUNT;
+    image.maxManaged = MAX_MANAGED;
+    image.headerSize = sizeof(memoryBlockHeader);
+    image.heapBase = (long long)(unsigned long)heap[0];
+    image.heapOffset = imageHeapOffset();
+    image.currentHeap = currentHeap;
+    image.allocationStrategy = allocationStrategy;
+    image.oldGenMode = oldGenMode;
+    image.managedListSize = managedListSize;
+    image.freeHandleCount = freeHandleCount;
+    image.plabTop = plabTop;
+    image.plabEnd = plabEnd;
+    image.plabLast = plabLast;
+    image.sweepCursor = sweepCursor;
+    image.sweepRunStart = sweepRunStart;
+
+    for (int h = 0; h < HEAP_COUNT; h++)
+    {
+        image.freeListHead[h] = freeListHead[h];
+    }
+
+    for (int h = 0; h < 2; h++)
+    {
+        image.tenuredCount[h] = tenuredCount[h];
+        memcpy(image.tenuredStart[h], tenuredStart[h], sizeof(tenuredStart[h]));
+        memcpy(image.tenuredEnd[h], tenuredEnd[h], sizeof(tenuredEnd[h]));
+    }
+
+    fwrite(&image, sizeof(image), 1, out);
+    fwrite(managedList, sizeof(void*), MAX_MANAGED, out);
+    fwrite(freeHandles, sizeof(int), MAX_MANAGED, out);
+    fwrite(markBits, sizeof(markBits), 1, out);
+    fwrite(managedWeak, 1, MAX_MANAGED, out);
+
+    // Pad up to the page the heaps start on
+    for (long long pos = ftell(out); pos < image.heapOffset; pos++)
+    {
+        putc(0, out);
+    }
+
+    fwrite(heap, HEAP_SIZE, HEAP_COUNT, out);
+
+    int failed = ferror(out);
+
+    if (fclose(out) != 0 || failed)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int duHeapMap(const char* path)
+{
+    FILE* in = fopen(path, "rb");
+    heapImage image;
+
+    if (in == 0)
+    {
+        return -1;
+    }
+
+    // Only an image from a build with the same layout can be used
+    if (fread(&image, sizeof(image), 1, in) != 1 || memcmp(image.magic, DU_HEAP_IMAGE_MAGIC, 8) != 0 ||
+        image.heapSize != HEAP_SIZE || image.heapCount != HEAP_COUNT || image.maxManaged != MAX_MANAGED ||
+        image.headerSize != (int)sizeof(memoryBlockHeader) || image.heapOffset != imageHeapOffset())
+    {
+        fclose(in);
+        return -1;
+    }
+
+    if (fread(managedList, sizeof(void*), MAX_MANAGED, in) != MAX_MANAGED ||
+        fread(freeHandles, sizeof(int), MAX_MANAGED, in) != MAX_MANAGED ||
+        fread(markBits, sizeof(markBits), 1, in) != 1 ||
+        fread(managedWeak, 1, MAX_MANAGED, in) != MAX_MANAGED)
+    {
+        fclose(in);
+        managedListSize = 0; // Leave no half-loaded handles behind
+        return -1;
+    }
+
+    long long mapped = 0;
+
+#ifdef DU_HOSTED
+    // Whole pages of the heaps are mapped from the file and faulted in as they are touched; writes stay private
+    if (sysconf(_SC_PAGESIZE) == REMAP_PAGE_SIZE)
+    {
+        mapped = (long long)HEAP_COUNT * HEAP_SIZE / REMAP_PAGE_SIZE * REMAP_PAGE_SIZE;
+
+        if (mapped > 0 && mmap(heap, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(in), image.heapOffset) == MAP_FAILED)
+        {
+            mapped = 0;
+        }
+    }
+#endif
+
+    // Whatever couldn't be mapped is read
+    fseek(in, image.heapOffset + mapped, SEEK_SET);
+
+    if (fread((unsigned char*)heap + mapped, 1, (long long)HEAP_COUNT * HEAP_SIZE - mapped, in) != (size_t)((long long)HEAP_COUNT * HEAP_SIZE - mapped))
+    {
+        fclose(in);
+        managedListSize = 0;
+        return -1;
+    }
+
+    fclose(in);
+
+    // Collector state
+    currentHeap = image.currentHeap;
+    allocationStrategy = image.allocationStrategy;
+    oldGenMode = image.oldGenMode;
+    managedListSize = image.managedListSize;
+    freeHandleCount = image.freeHandleCount;
+    plabTop = imageRebase(image.plabTop, image.heapBase);
+    plabEnd = imageRebase(image.plabEnd, image.heapBase);
+    plabLast = imageRebase(image.plabLast, image.heapBase);
+    sweepCursor = imageRebase(image.sweepCursor, image.heapBase);
+    sweepRunStart = imageRebase(image.sweepRunStart, image.heapBase);
+
+    for (int h = 0; h < 2; h++)
+    {
+        tenuredCount[h] = image.tenuredCount[h];
+
+        for (int s = 0; s < tenuredCount[h]; s++)
+        {
+            tenuredStart[h][s] = imageRebase(image.tenuredStart[h][s], image.heapBase);
+            tenuredEnd[h][s] = imageRebase(image.tenuredEnd[h][s], image.heapBase);
+        }
+    }
+
+    // Free lists are rebased link by link, which only touches the pages of free block headers
+    for (int h = 0; h < HEAP_COUNT; h++)
+    {
+        heapDirtyBytes[h] = HEAP_SIZE;
+
+        if (h != currentHeap && h != 2)
+        {
+            freeListHead[h] = 0; // The idle semispace's list is rebuilt by the next minorCollection
+            continue;
+        }
+
+        freeListHead[h] = imageRebase(image.freeListHead[h], image.heapBase);
+
+        for (memoryBlockHeader* current = freeListHead[h]; current != 0; current = current->next)
+        {
+            current->next = imageRebase(current->next, image.heapBase);
+        }
+    }
+
+    for (int i = 0; i < managedListSize; i++)
+    {
+        managedList[i] = imageRebase(managedList[i], image.heapBase);
+    }
+
+    // Nothing else carries over from the process that saved the image
+    for (int i = 0; i < MAX_MANAGED; i++)
+    {
+        managedPinCount[i] = 0;
+        profileSiteOf[i] = -1;
+        directPointerWords[i] = -1; // Direct objects stay as blocks nothing can free
+        allocationSite[i] = PRETENURE_SITES; // Call sites and access history belong to the old process
+        duAccessStamp[i] = 0;
+    }
+
+    memset(profileSites, 0, sizeof(profileSites));
+    memset(pretenureSites, 0, sizeof(pretenureSites));
+    memset(&stats, 0, sizeof(stats));
+    duAccessClock = 0;
+    handleScopeDepth = 0;
+    weakClearedCount = 0;
+    directLive = 0;
+
+    if (sideMetadata)
+    {
+        rebuildBlockStarts();
+    }
+    arenaTop = arena;
+    arenaDepth = 0;
+
+    if (kernelLevel < 0)
+    {
+        duSetKernelLevel(DU_KERNEL_BEST);
+    }
+
+    if (heapLimit > 0)
+    {
+        measureHeapUse(); // The stats the estimate builds on were just reset
+    }
+
+    return 0;
+}
+
+long long imageHeapOffset()
+{
+    long long metadata = sizeof(heapImage) + (long long)MAX_MANAGED * (sizeof(void*) + sizeof(int) + 1) + sizeof(markBits);
+    return (metadata + REMAP_PAGE_SIZE - 1) / REMAP_PAGE_SIZE * REMAP_PAGE_SIZE;
+}
+
+void* imageRebase(void* ptr, long long savedBase)
+{
+    // Pointers into the saved heaps move by however far the heaps moved; anything else can't be followed
+    long long offset = (long long)(unsigned long)ptr - savedBase;
+
+    if (ptr == 0 || offset < 0 || offset > (long long)HEAP_COUNT * HEAP_SIZE)
+    {
+        return 0;
+    }
+
+    return (unsigned char*)heap + offset;
+}
+
+void duSetAutoPretenure(int enabled)
+{
+    autoPretenure = enabled;
+}
+
+pretenureSite* pretenureFind(void* caller, int add)
+{
+    unsigned long slot = ((unsigned long)caller >> 2) % PRETENURE_SITES;
+
+    for (int probe = 0; probe < PRETENURE_SITES; probe++)
+    {
+        pretenureSite* site = &pretenureSites[(slot + probe) % PRETENURE_SITES];
+
+        if (site->caller == caller)
+        {
+            return site;
+        }
+
+        if (site->caller == 0)
+        {
+            if (!add)
+            {
+                return 0;
+            }
+
+            site->caller = caller;
+            return site;
+        }
+    }
+
+    return 0; // Table full
+}
+
+int shouldPretenure(void* caller)
+{
+    pretenureSite* site = pretenureFind(caller, 0);
+
+    return site != 0 && site->samples >= PRETENURE_MIN_SAMPLES && site->promoted * 100 >= site->samples * PRETENURE_PERCENT;
+}
+
+long long duSetHeapLimit(long long bytes)
+{
+    if (bytes == DU_HEAP_LIMIT_CGROUP)
+    {
+        bytes = cgroupMemoryLimit();
+    }
+
+    heapLimit = (bytes > 0) ? bytes : 0;
+    pressureThreshold = heapLimit;
+
+    if (heapLimit > 0)
+    {
+        measureHeapUse();
+    }
+
+    return heapLimit;
+}
+
+int duAddPressureCallback(duPressureCallback callback, void* context)
+{
+    for (int i = 0; i < MAX_PRESSURE_CALLBACKS; i++)
+    {
+        if (pressureHandlers[i].callback == 0)
+        {
+            pressureHandlers[i].callback = callback;
+            pressureHandlers[i].context = context;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void duRemovePressureCallback(duPressureCallback callback, void* context)
+{
+    for (int i = 0; i < MAX_PRESSURE_CALLBACKS; i++)
+    {
+        if (pressureHandlers[i].callback == callback && pressureHandlers[i].context == context)
+        {
+            pressureHandlers[i].callback = 0;
+        }
+    }
+}
+
+long long heapUsedBytes()
+{
+    unsigned long long blocks, freeBytes, largest;
+    int fragmentation;
+    long long used = 0;
+
+    summarizeFreeList(currentHeap, &blocks, &freeBytes, &largest, &fragmentation);
+    used += HEAP_SIZE - freeBytes;
+
+    // The idle semispace only holds its tenured spans
+    for (int s = 0; s < tenuredCount[1 - currentHeap]; s++)
+    {
+        used += tenuredEnd[1 - currentHeap][s] - tenuredStart[1 - currentHeap][s];
+    }
+
+    summarizeFreeList(2, &blocks, &freeBytes, &largest, &fragmentation);
+    used += HEAP_SIZE - freeBytes;
+
+    // Dead blocks lazy sweeping hasn't reached yet are as good as free
+    unsigned char* unswept = (sweepRunStart != 0) ? sweepRunStart : sweepCursor;
+
+    while (sideMetadata && unswept != 0 && unswept < heap[2] + HEAP_SIZE)
+    {
+        unsigned char* live = nextMarkedBlock(unswept);
+
+        used -= live - unswept;
+        unswept = (live < heap[2] + HEAP_SIZE) ? nextOldBlock(live) : 0;
+    }
+
+    while (!sideMetadata && unswept != 0 && unswept < heap[2] + HEAP_SIZE)
+    {
+        memoryBlockHeader* block = (memoryBlockHeader*)unswept;
+
+        if (block->free == 1 || !isMarked(block))
+        {
+            used -= sizeof(memoryBlockHeader) + block->size;
+        }
+
+        unswept += sizeof(memoryBlockHeader) + block->size;
+    }
+
+    return used;
+}
+
+long long estimatedUsedBytes()
+{
+    return usedAtCollection + (long long)(stats.bytesReserved - reservedAtCollection) - (long long)(stats.bytesFreed - freedAtCollection);
+}
+
+void measureHeapUse()
+{
+    usedAtCollection = heapUsedBytes();
+    reservedAtCollection = stats.bytesReserved;
+    freedAtCollection = stats.bytesFreed;
+
+    if (usedAtCollection < heapLimit)
+    {
+        pressureThreshold = heapLimit; // Back under, so the limit applies in full again
+    }
+}
+
+void enforceHeapLimit(int size)
+{
+    long long needed = size + sizeof(memoryBlockHeader);
+
+    TRACE_EVENT("heapLimit", 'B', estimatedUsedBytes());
+
+    // The nursery is cheapest to collect; heap[2] only if that wasn't enough
+    minorCollection();
+
+    if (usedAtCollection + needed > heapLimit)
+    {
+        majorCollection();
+    }
+
+    if (usedAtCollection + needed > heapLimit)
+    {
+        notifyPressure(DU_PRESSURE_SOFT, usedAtCollection);
+
+        // Whatever the callbacks freed counts now; without this every allocation would collect again
+        long long used = estimatedUsedBytes();
+        pressureThreshold = (used + needed > heapLimit) ? used + heapLimit / HEAP_LIMIT_REARM_DIVISOR : heapLimit;
+    }
+
+    TRACE_EVENT("heapLimit", 'E', -1);
+}
+
+void notifyPressure(int level, long long usedBytes)
+{
+    if (notifyingPressure)
+    {
+        return;
+    }
+
+    notifyingPressure = 1;
+
+    for (int i = 0; i < MAX_PRESSURE_CALLBACKS; i++)
+    {
+        if (pressureHandlers[i].callback != 0)
+        {
+            pressureHandlers[i].callback(level, usedBytes, heapLimit, pressureHandlers[i].context);
+        }
+    }
+
+    notifyingPressure = 0;
+}
+
+long long cgroupMemoryLimit()
+{
+#ifdef DU_HOSTED
+    // cgroup v2 first, then v1; both say there is no limit in their own way
+    const char* paths[] = { "/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes" };
+
+    for (int p = 0; p < 2; p++)
+    {
+        FILE* in = fopen(paths[p], "r");
+        long long limit = 0;
+
+        if (in == 0)
+        {
+            continue;
+        }
+
+        int found = fscanf(in, "%lld", &limit);
+        fclose(in);
+
+        if (found == 1 && limit > 0 && limit < (1LL << 60))
+        {
+            return limit;
+        }
+
+        return 0; // "max", or v1's page-rounded LLONG_MAX
+    }
+#endif
+
+    return 0;
+}
+
+void duSetWeak(void** mptr, int weak)
+{
+    managedWeak[mptr - managedList] = (weak != 0);
+}
+
+void duSetWeakNotify(int enabled)
+{
+    weakNotify = enabled;
+    weakClearedCount = 0;
+}
+
+void** duNextClearedWeak()
+{
+    while (weakClearedCount > 0)
+    {
+        int slot = weakCleared[weakClearedHead];
+
+        weakClearedHead = (weakClearedHead + 1) % MAX_MANAGED;
+        weakClearedCount--;
+
+        // Skip slots that were made strong or hold a new block since
+        if (managedWeak[slot] && managedList[slot] == 0)
+        {
+            return &managedList[slot];
+        }
+    }
+
+    return 0;
+}
+
+void clearWeakHandles(int oldGeneration)
+{
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (!managedWeak[i] || managedList[i] == 0 || managedPinCount[i] > 0)
+        {
+            continue; // Strong, already cleared, or in use through a raw pointer
+        }
+
+        memoryBlockHeader* header = (memoryBlockHeader*)((unsigned char*)managedList[i] - sizeof(memoryBlockHeader));
+
+        if (isYoungBlock(header) == oldGeneration)
+        {
+            continue; // This collection doesn't reclaim its generation
+        }
+
+        // Without a handle the block is garbage to the collector, like any other unreferenced block
+        if (recordingOut != 0)
+        {
+            recordingWrite(DU_RECORD_FREE, i, -1);
+        }
+
+        profileFreed(i);
+        managedList[i] = 0;
+        stats.weakCleared++;
+
+        if (weakNotify && weakClearedCount < MAX_MANAGED)
+        {
+            weakCleared[(weakClearedHead + weakClearedCount) % MAX_MANAGED] = i;
+            weakClearedCount++;
+        }
+    }
+}
+
+void duSetSideMetadata(int enabled)
+{
+    // Bits aren't kept while the mode is off, so they are rebuilt from the headers once
+    if (enabled && !sideMetadata)
+    {
+        rebuildBlockStarts();
+    }
+
+    sideMetadata = enabled;
+}
+
+void rebuildBlockStarts()
+{
+    memset(blockStartBits, 0, sizeof(blockStartBits));
+
+    // Outside collections the promotion buffer is retired, so heap[2] is one unbroken chain of blocks
+    for (unsigned char* block = heap[2]; block < heap[2] + HEAP_SIZE; block += sizeof(memoryBlockHeader) + ((memoryBlockHeader*)block)->size)
+    {
+        int granule = (block - heap[2]) / 8;
+        blockStartBits[granule / 64] |= 1ULL << (granule % 64);
+    }
+}
+
+void noteBlockStart(void* header)
+{
+    unsigned char* block = header;
+
+    if (sideMetadata && block >= heap[2] && block < heap[2] + HEAP_SIZE)
+    {
+        int granule = (block - heap[2]) / 8;
+        __atomic_fetch_or(&blockStartBits[granule / 64], 1ULL << (granule % 64), __ATOMIC_RELAXED); // Compaction threads share the words at chunk edges
+    }
+}
+
+void forgetBlockStarts(unsigned char* start, unsigned char* end)
+{
+    if (!sideMetadata || start < heap[2] || start >= heap[2] + HEAP_SIZE)
+    {
+        return;
+    }
+
+    int first = (start - heap[2]) / 8;
+    int last = (end - heap[2] + 7) / 8; // Exclusive
+
+    // Partial words at either end, whole words in between
+    for (int g = first; g < last && g % 64 != 0; g++)
+    {
+        blockStartBits[g / 64] &= ~(1ULL << (g % 64));
+        first = g + 1;
+    }
+
+    for (; first + 64 <= last; first += 64)
+    {
+        blockStartBits[first / 64] = 0;
+    }
+
+    for (int g = first; g < last; g++)
+    {
+        blockStartBits[g / 64] &= ~(1ULL << (g % 64));
+    }
+}
+
+int nextSetGranule(unsigned long long* bits, int from)
+{
+    int limit = HEAP_SIZE / 8;
+
+    if (from >= limit)
+    {
+        return limit;
+    }
+
+    int word = from / 64;
+    unsigned long long current = bits[word] & (~0ULL << (from % 64));
+
+    while (current == 0)
+    {
+        if (++word >= (limit + 63) / 64)
+        {
+            return limit;
+        }
+
+        current = bits[word];
+    }
+
+    int granule = word * 64 + __builtin_ctzll(current);
+    return (granule < limit) ? granule : limit;
+}
+
+unsigned char* nextOldBlock(unsigned char* block)
+{
+    return heap[2] + (long)nextSetGranule(blockStartBits, (block - heap[2]) / 8 + 1) * 8;
+}
+
+unsigned char* nextMarkedBlock(unsigned char* from)
+{
+    return heap[2] + (long)nextSetGranule(markBits, (from - heap[2] + 7) / 8) * 8;
+}
+
+void duSetCopyOrder(int order)
+{
+    copyOrder = order;
+}
+
+int orderSurvivors()
+{
+    int count = 0;
+
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (managedList[i] != NULL && isYoungBlock((memoryBlockHeader*)((unsigned char*)managedList[i] - sizeof(memoryBlockHeader))))
+        {
+            survivorOrder[count++] = i;
+        }
+    }
+
+    qsort(survivorOrder, count, sizeof(int), (copyOrder == DU_COPY_ORDER_SITE) ? compareSurvivorSites : compareSurvivorStamps);
+    return count;
+}
+
+int compareSurvivorSites(const void* a, const void* b)
+{
+    int first = *(const int*)a;
+    int second = *(const int*)b;
+
+    if (allocationSite[first] != allocationSite[second])
+    {
+        return allocationSite[first] - allocationSite[second];
+    }
+
+    return first - second; // Allocation order within a site
+}
+
+int compareSurvivorStamps(const void* a, const void* b)
+{
+    int first = *(const int*)a;
+    int second = *(const int*)b;
+
+    // Never-touched blocks (stamp 0) go last
+    unsigned int firstStamp = duAccessStamp[first] - 1;
+    unsigned int secondStamp = duAccessStamp[second] - 1;
+
+    if (firstStamp != secondStamp)
+    {
+        return (firstStamp < secondStamp) ? -1 : 1;
+    }
+
+    return first - second;
+}
+
+void* duDirectMalloc(int size, int pointerCount)
+{
+    if (stackBase == 0)
+    {
+        findStackBase();
+    }
+
+    if (stackBase == 0 || pointerCount < 0 || pointerCount > size / (int)sizeof(void*))
+    {
+        return 0; // Nothing could find the object again, or its pointer fields don't fit
+    }
+
+    void** mptr = managedMalloc(size, DU_LIFETIME_UNKNOWN, __builtin_return_address(0));
+
+    if (mptr == 0)
+    {
+        return 0;
+    }
+
+    // Collections read the pointer fields before the caller may have set them, and reused memory holds anything
+    void** fields = *mptr;
+
+    for (int f = 0; f < pointerCount; f++)
+    {
+        fields[f] = 0;
+    }
+
+    directPointerWords[mptr - managedList] = pointerCount;
+    directLive++;
+
+    return *mptr;
+}
+
+void duDirectFree(void* ptr)
+{
+    if (ptr != 0)
+    {
+        duManagedFree(&managedList[((memoryBlockHeader*)((unsigned char*)ptr - sizeof(memoryBlockHeader)))->managedIndex]);
+    }
+}
+
+void duSetStackBase(void* base)
+{
+    stackBase = base;
+}
+
+void findStackBase()
+{
+#ifdef DU_HOSTED
+    pthread_attr_t attributes;
+    void* low;
+    size_t size;
+
+    if (pthread_getattr_np(pthread_self(), &attributes) == 0)
+    {
+        if (pthread_attr_getstack(&attributes, &low, &size) == 0)
+        {
+            stackBase = (unsigned char*)low + size;
+        }
+
+        pthread_attr_destroy(&attributes);
+    }
+#endif
+}
+
+void directMark()
+{
+    directSortedCount = 0;
+
+    if (directLive == 0)
+    {
+        return;
+    }
+
+    // Walking the heaps in address order lists the direct objects already sorted
+    for (int h = 0; h < HEAP_COUNT; h++)
+    {
+        if (h == currentHeap || h == 2)
+        {
+            directCollect(heap[h], heap[h] + HEAP_SIZE);
+            continue;
+        }
+
+        for (int s = 0; s < tenuredCount[h]; s++)
+        {
+            directCollect(tenuredStart[h][s], tenuredEnd[h][s]);
+        }
+    }
+
+    // Whatever the stack points at stays put; everything reached only through pointer fields may move
+    directWorkCount = 0;
+    directScanStack();
+
+    while (directWorkCount > 0)
+    {
+        int slot = directWork[--directWorkCount];
+        void** fields = managedList[slot];
+
+        for (int f = 0; f < directPointerWords[slot]; f++)
+        {
+            int target = directFieldTarget(fields[f]);
+
+            if (target >= 0)
+            {
+                directReach(target, 0);
+                fields[f] = (void*)(((unsigned long)target << 1) | 1); // Odd, so directFixup knows it from an address
+            }
+        }
+    }
+
+    for (int k = 0; k < directSortedCount; k++)
+    {
+        int slot = directSorted[k];
+
+        if (directReached[slot])
+        {
+            continue;
+        }
+
+        // The program can't get at it any more, so free it the way duManagedFree would, minus the block
+        if (recordingOut != 0)
+        {
+            recordingWrite(DU_RECORD_FREE, slot, -1);
+        }
+
+        profileFreed(slot);
+        managedList[slot] = 0;
+        directPointerWords[slot] = -1;
+        directLive--;
+        stats.directFreed++;
+
+        if (recycleHandles && freeHandleCount < MAX_MANAGED)
+        {
+            freeHandles[freeHandleCount++] = slot;
+        }
+    }
+}
+
+void directCollect(unsigned char* start, unsigned char* end)
+{
+    for (unsigned char* block = start; block < end; block += sizeof(memoryBlockHeader) + ((memoryBlockHeader*)block)->size)
+    {
+        memoryBlockHeader* header = (memoryBlockHeader*)block;
+        int slot = header->managedIndex;
+
+        if (header->free == 0 && isReferenced(header) && directPointerWords[slot] >= 0)
+        {
+            directOldAddress[directSortedCount] = managedList[slot];
+            directSorted[directSortedCount++] = slot;
+            directReached[slot] = 0;
+        }
+    }
+}
+
+void directScanStack()
+{
+    jmp_buf registers;
+
+    // Pointers the caller keeps only in callee-saved registers end up in this frame
+    __builtin_unwind_init();
+    setjmp(registers);
+
+    void** word = (void**)((unsigned long)&registers & ~(unsigned long)(sizeof(void*) - 1));
+
+    for (; word < (void**)stackBase; word++)
+    {
+        int k = directStackTarget(*word);
+
+        if (k >= 0)
+        {
+            directReach(directSorted[k], 1);
+        }
+    }
+}
+
+void directReach(int slot, int fromStack)
+{
+    if (directReached[slot] == 0)
+    {
+        directReached[slot] = 1;
+        directWork[directWorkCount++] = slot;
+    }
+
+    if (fromStack && directReached[slot] == 1)
+    {
+        managedPinCount[slot]++; // Undone by directFixup
+        directReached[slot] = 2;
+    }
+}
+
+int directStackTarget(void* word)
+{
+    unsigned char* target = word;
+
+    // Most stack words aren't heap addresses at all
+    if (directSortedCount == 0 || target < (unsigned char*)directOldAddress[0] || target >= heap[0] + HEAP_COUNT * HEAP_SIZE)
+    {
+        return -1;
+    }
+
+    // The stack may point anywhere into an object, so find the last one starting at or below the word
+    int low = 0;
+    int high = directSortedCount - 1;
+
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+
+        if ((unsigned char*)directOldAddress[middle] <= target)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+
+    unsigned char* payload = directOldAddress[low];
+    return (target < payload + ((memoryBlockHeader*)(payload - sizeof(memoryBlockHeader)))->size) ? low : -1;
+}
+
+int directFieldTarget(void* word)
+{
+    unsigned char* target = word;
+
+    // Pointer fields hold an object's start, so its header says which slot it is
+    if (target < heap[0] + sizeof(memoryBlockHeader) || target >= heap[0] + HEAP_COUNT * HEAP_SIZE || ((unsigned long)target & 7) != 0)
+    {
+        return -1;
+    }
+
+    int slot = ((memoryBlockHeader*)(target - sizeof(memoryBlockHeader)))->managedIndex;
+
+    if (slot < 0 || slot >= managedListSize || managedList[slot] != word || directPointerWords[slot] < 0)
+    {
+        return -1;
+    }
+
+    return slot;
+}
+
+void directFixup()
+{
+    // Pointer fields were swapped for their targets' slots while marking; now the slots hold the new addresses
+    for (int k = 0; k < directSortedCount; k++)
+    {
+        int slot = directSorted[k];
+
+        if (!directReached[slot])
+        {
+            continue;
+        }
+
+        void** fields = managedList[slot];
+
+        for (int f = 0; f < directPointerWords[slot]; f++)
+        {
+            unsigned long tag = (unsigned long)fields[f];
+
+            if ((tag & 1) && (tag >> 1) < (unsigned long)managedListSize)
+            {
+                fields[f] = managedList[tag >> 1];
+            }
+        }
+
+        if (directReached[slot] == 2)
+        {
+            managedPinCount[slot]--;
+        }
+
+        directReached[slot] = 0;
+    }
+
+    directSortedCount = 0;
+}
+
+int duSetCompactThreads(int threads)
+{
+#ifdef DU_HOSTED
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    compactThreads = (threads < 1) ? 1 : (threads > MAX_COMPACT_THREADS) ? MAX_COMPACT_THREADS : threads;
+#else
+    (void)threads;
+    compactThreads = 1; // No threads without the host
+#endif
+
+    return compactThreads;
+}
+
+unsigned char* compactOldGeneration()
+{
+    compactChunk chunks[MAX_COMPACT_THREADS];
+    int chunkCount = 1;
+
+    // One chunk covering the whole heap is the serial compaction
+    chunks[0].srcStart = heap[2];
+    chunks[0].srcEnd = heap[2] + HEAP_SIZE;
+    chunks[0].dest = heap[2];
+    chunks[0].useMarks = sideMetadata;
+    chunks[0].freeHead = 0;
+    chunks[0].freeTail = 0;
+
+    if (compactThreads > 1)
+    {
+        chunkCount = planCompactChunks(chunks);
+    }
+    else if (sideMetadata)
+    {
+        markOldBlocks(0); // Live blocks are found from the mark bits, so dead ones are stepped over unread
+    }
+
+#ifdef DU_HOSTED
+    pthread_t threads[MAX_COMPACT_THREADS];
+    int started[MAX_COMPACT_THREADS];
+
+    for (int c = 1; c < chunkCount; c++)
+    {
+        started[c] = (pthread_create(&threads[c], 0, compactChunkThread, &chunks[c]) == 0);
+    }
+#endif
+
+    compactChunkRun(&chunks[0]);
+
+#ifdef DU_HOSTED
+    for (int c = 1; c < chunkCount; c++)
+    {
+        if (started[c])
+        {
+            pthread_join(threads[c], 0);
+        }
+        else
+        {
+            compactChunkRun(&chunks[c]); // Chunks don't depend on each other, so it can just go last
+        }
+    }
+#endif
+
+    // Link the chunks' gaps into one free list; every chunk but the last also leaves its unused end behind
+    memoryBlockHeader* tail = 0;
+
+    for (int c = 0; c < chunkCount; c++)
+    {
+        if (c < chunkCount - 1 && chunks[c].dest < chunks[c].srcEnd)
+        {
+            addCompactionGap(&chunks[c], chunks[c].dest, chunks[c].srcEnd);
+        }
+
+        memoryBlockHeader* head = chunks[c].freeHead;
+
+        if (head == 0)
+        {
+            continue;
+        }
+
+        if (tail != 0 && (unsigned char*)tail + sizeof(memoryBlockHeader) + tail->size == (unsigned char*)head)
+        {
+            // A chunk's unused end runs into the gap in front of the next chunk's first block, which must be pinned
+            tail->size += sizeof(memoryBlockHeader) + head->size;
+            tail->next = head->next;
+            forgetBlockStarts((unsigned char*)head, (unsigned char*)head + 1);
+
+            if (chunks[c].freeTail != head)
+            {
+                tail = chunks[c].freeTail;
+            }
+        }
+        else
+        {
+            if (tail != 0)
+            {
+                tail->next = head;
+            }
+            else
+            {
+                freeListHead[2] = head;
+            }
+
+            tail = chunks[c].freeTail;
+        }
+    }
+
+    return chunks[chunkCount - 1].dest;
+}
+
+int planCompactChunks(compactChunk* chunks)
+{
+    markOldBlocks(1); // Also the summary: live bytes per region and where its last live block ends
+
+    long long liveBytes = 0;
+
+    for (int r = 0; r < COMPACT_REGION_COUNT; r++)
+    {
+        liveBytes += compactRegionLive[r];
+    }
+
+    chunks[0].useMarks = 1; // The marks are there now, so no chunk has to read dead blocks' headers
+
+    if (liveBytes < PARALLEL_COMPACT_MIN_BYTES)
+    {
+        return 1;
+    }
+
+    // Cut in front of the first region holding live blocks past each thread's share of the live bytes. The chunk
+    // before a cut ends with its last live block, and the new one moves its blocks down to there.
+    int count = 1;
+    long long liveBefore = 0;
+    unsigned char* liveEnd = heap[2]; // End of the last live block in the regions so far
+
+    for (int r = 0; r < COMPACT_REGION_COUNT && count < compactThreads; r++)
+    {
+        if (compactRegionEnd[r] != 0 && liveBefore >= liveBytes * count / compactThreads)
+        {
+            chunks[count - 1].srcEnd = liveEnd;
+            chunks[count].srcStart = nextMarkedBlock(heap[2] + (long)r * COMPACT_REGION_SIZE);
+            chunks[count].srcEnd = heap[2] + HEAP_SIZE;
+            chunks[count].dest = liveEnd;
+            chunks[count].useMarks = 1;
+            chunks[count].freeHead = 0;
+            chunks[count].freeTail = 0;
+            count++;
+        }
+
+        liveBefore += compactRegionLive[r];
+
+        if (compactRegionEnd[r] > liveEnd)
+        {
+            liveEnd = compactRegionEnd[r];
+        }
+    }
+
+    return count;
+}
+
+void* compactChunkThread(void* chunk)
+{
+    compactChunkRun(chunk);
+    return 0;
+}
+
+void compactChunkRun(compactChunk* chunk)
+{
+    unsigned char* destPtr = chunk->dest;
+    memoryBlockHeader* src = (memoryBlockHeader*)(chunk->useMarks ? nextMarkedBlock(chunk->srcStart) : chunk->srcStart);
+
+    TRACE_EVENT("compactChunk", 'B', chunk->srcEnd - chunk->srcStart);
+
+    while ((unsigned char*)src < chunk->srcEnd)
+    {
+        int totalSize = sizeof(memoryBlockHeader) + src->size;
+        unsigned char* next = chunk->useMarks ? nextMarkedBlock((unsigned char*)src + totalSize) : (unsigned char*)src + totalSize;
+
+        if (src->free == 0 && isPinned(src))
+        {
+            if ((unsigned char*)src != destPtr)
+            {
+                // Blocks can't slide past a pinned one; the dead space in front of it stays free
+                addCompactionGap(chunk, destPtr, (unsigned char*)src);
+            }
+
+            noteBlockStart(src);
+            destPtr = (unsigned char*)src + totalSize;
+        }
+        else if (src->free == 0 && isReferenced(src))
+        {
+            int remapped = 0;
+
+            if ((unsigned char*)src != destPtr && largeBlockRemap && totalSize >= REMAP_THRESHOLD)
+            {
+                // Large blocks keep their offset within a page so their pages can be remapped instead of copied
+                int pad = ((unsigned char*)src - destPtr) % REMAP_PAGE_SIZE;
+
+                if (pad == 0 || pad >= (int)sizeof(memoryBlockHeader))
+                {
+                    if (pad > 0)
+                    {
+                        addCompactionGap(chunk, destPtr, destPtr + pad); // The padding becomes a free block in front of the moved block
+                    }
+
+                    destPtr += pad;
+                    remapped = (unsigned char*)src == destPtr || remapBlock(destPtr, (unsigned char*)src, totalSize);
+                }
+            }
+
+            if ((unsigned char*)src != destPtr)
+            {
+                // Move block forward
+                if (!remapped && (unsigned char*)src - destPtr >= totalSize)
+                {
+                    duBulkCopy(destPtr, src, totalSize);
+                }
+                else if (!remapped)
+                {
+                    memmove(destPtr, src, totalSize); // Source and destination overlap
+                }
+
+                memoryBlockHeader* newHeader = (memoryBlockHeader*)destPtr;
+
+                // Update managed pointer to new location; every block has its own slot, so threads never share one
+                if (newHeader->managedIndex >= 0 && newHeader->managedIndex < MAX_MANAGED)
+                {
+                    managedList[newHeader->managedIndex] = (unsigned char*)newHeader + sizeof(memoryBlockHeader);
+                }
+            }
+
+            noteBlockStart(destPtr);
+            destPtr += totalSize;
+        }
+
+        src = (memoryBlockHeader*)next;
+    }
+
+    chunk->dest = destPtr;
+
+    TRACE_EVENT("compactChunk", 'E', -1);
+}
+
+void addCompactionGap(compactChunk* chunk, unsigned char* start, unsigned char* end)
+{
+    memoryBlockHeader* gap = (memoryBlockHeader*)start;
+    gap->size = end - start - sizeof(memoryBlockHeader);
+    gap->free = 1;
+    gap->managedIndex = -1;
+    gap->survivalCount = 0;
+    gap->next = 0;
+
+    // Gaps come in address order, so appending keeps the chunk's list sorted like the free list
+    if (chunk->freeTail != 0)
+    {
+        chunk->freeTail->next = gap;
+    }
+    else
+    {
+        chunk->freeHead = gap;
+    }
+
+    chunk->freeTail = gap;
+    noteBlockStart(gap);
 }
@@ -1,17 +1,259 @@
 #ifndef DUMALLOC_H
 #define DUMALLOC_H
 
+#include <stdio.h>
+
 #define FIRST_FIT 0
 #define BEST_FIT 1
 
+#define OLD_GEN_COMPACT 0    // majorCollection slides live blocks together (default)
+#define OLD_GEN_MARK_SWEEP 1 // majorCollection marks in place and sweeps lazily
+
+#define DU_PROFILE_HEAP 0     // Live and allocated bytes per allocation site
+#define DU_PROFILE_PROMOTED 1 // Promoted and allocated bytes per allocation site
+
+// JSON snapshots list each heap's blocks as [offset, size, flags, managedIndex] and free list as [offset, size],
+// then the handles as [heap, offset, size] or null
+#define DU_SNAPSHOT_JSON 0   // duHeapSnapshot writes one JSON document
+#define DU_SNAPSHOT_BINARY 1 // duHeapSnapshot writes a stream of duSnapshotRecord
+
+// Recordings start with DU_RECORD_MAGIC and the numbers HEAP_SIZE, strategy, old generation mode and handle count.
+// Each call is then an op byte followed by its numbers, seven bits per byte with the high bit meaning "more".
+#define DU_RECORD_MAGIC "DUR1"
+#define DU_RECORD_MALLOC 'a' // size, handle + 1 (0 when the allocation failed)
+#define DU_RECORD_MALLOC_OLD 'l' // Like DU_RECORD_MALLOC, for a block placed straight in the old generation
+#define DU_RECORD_FREE 'f'   // handle, also written when a collection clears a weak handle or frees a direct object
+#define DU_RECORD_MOVE 'v'   // from handle, to handle (duHandleScopeEscape)
+#define DU_RECORD_MINOR 'm'
+#define DU_RECORD_MAJOR 'M'
+#define DU_RECORD_INIT 'i'   // strategy
+#define DU_RECORD_END 'e'
+
+#define DU_PAUSE_SUB_BUCKETS 8 // Histogram buckets per power of two, so about 12% precision
+#define DU_PAUSE_BUCKETS 272 // Enough buckets for pauses up to 2^36 ns (about 68 seconds)
+
+// Pause times of one kind of collection, in nanoseconds.
+// Pauses under 16 ns get a bucket each; above that every power of two is split into DU_PAUSE_SUB_BUCKETS.
+typedef struct duPauseHistogram {
+    unsigned long long count;   // Collections recorded
+    unsigned long long totalNs; // Sum of all pauses
+    unsigned long long maxNs;   // Longest pause
+    unsigned long long buckets[DU_PAUSE_BUCKETS];
+} duPauseHistogram;
+
+typedef struct duStats {
+    // Counted as they happen since duManagedInitMalloc
+    unsigned long long allocations;
+    unsigned long long allocationFailures;
+    unsigned long long frees;
+    unsigned long long bytesRequested; // Sizes asked for
+    unsigned long long bytesReserved;  // Space handed out, including headers and alignment
+    unsigned long long bytesFreed;     // Reserved space given back by frees
+    unsigned long long survivorBytes;  // Bytes copied within the nursery by minorCollection
+    unsigned long long promotedBytes;  // Bytes moved (or promoted in place) into the old generation
+    unsigned long long pretenuredBytes; // Bytes allocated straight into the old generation
+    unsigned long long weakCleared;    // Weak handles cleared by collections
+    unsigned long long directFreed;    // Direct objects collections found unreachable
+
+    // Measured from the free lists when duGetStats is called
+    unsigned long long nurseryFreeBlocks;
+    unsigned long long nurseryFreeBytes;
+    unsigned long long nurseryLargestFree;
+    int nurseryFragmentation; // Percent of free space outside the largest free block
+    unsigned long long oldFreeBlocks;
+    unsigned long long oldFreeBytes;
+    unsigned long long oldLargestFree;
+    int oldFragmentation;
+    unsigned long long usedBytes; // Heap bytes neither free nor dead, the figure duSetHeapLimit limits
+
+    duPauseHistogram minorPauses;
+    duPauseHistogram majorPauses;
+} duStats;
+
+// Binary heap snapshots are a header record, then the blocks, free list entries and handles, then an end record.
+// Fields are host-endian ints.
+#define DU_SNAPSHOT_MAGIC 0x50414e53 // Kind of the header record; its flags hold DU_SNAPSHOT_VERSION
+#define DU_SNAPSHOT_VERSION 1
+#define DU_SNAPSHOT_BLOCK 1
+#define DU_SNAPSHOT_FREE_ENTRY 2
+#define DU_SNAPSHOT_HANDLE 3 // heap is -1 for a freed handle
+#define DU_SNAPSHOT_END 4
+
+#define DU_SNAPSHOT_FREE 1        // Block flags
+#define DU_SNAPSHOT_REFERENCED 2  // A handle points at the block
+#define DU_SNAPSHOT_TENURED 4     // Inside a span of a semispace that was promoted in place
+#define DU_SNAPSHOT_PINNED 8      // Held in place by duPin
+#define DU_SNAPSHOT_WEAK 16       // Referenced only by a weak handle
+#define DU_SNAPSHOT_SURVIVAL_SHIFT 8 // Survival count sits above the flag bits
+
+typedef struct duSnapshotRecord {
+    int kind;
+    int heap;         // The header record has the heap count here
+    int offset;       // Block header offset in its heap; the header record has the current heap here
+    int size;         // Payload size; the header record has HEAP_SIZE here
+    int managedIndex; // The header record has the handle count here
+    int flags;
+} duSnapshotRecord;
+
 void duManagedInitMalloc(int searchType);
 void** duManagedMalloc(int size);
 void duManagedFree(void** mptr);
 void duMemoryDump();
-void minorCollection();
+
+// Lifetime hints: LONG allocates in the old generation, SHORT always in the nursery. UNKNOWN is what
+// duManagedMalloc uses; with auto-pretenuring on, it goes to the old generation for call sites whose profile
+// samples have mostly been promoted. Auto-pretenuring learns only while the profiler samples.
+#define DU_LIFETIME_UNKNOWN 0
+#define DU_LIFETIME_SHORT 1
+#define DU_LIFETIME_LONG 2
+
+void** duManagedMallocHint(int size, int lifetime);
+void duSetAutoPretenure(int enabled); // Needs duProfileSetSampleRate
+
+// A pinned block keeps its address through collections, so the raw pointer duPin returns can be used
+// until the matching duUnpin. Pins nest. Young pinned blocks are promoted where they stand.
+void* duPin(void** mptr);
+void duUnpin(void** mptr);
+
+// Arena scopes: duArenaMalloc bump-allocates into the innermost open scope and duArenaEnd releases all of
+// that scope's objects at once. Arena objects have no handle and never move; duArenaEscape copies one into
+// the managed heap when it has to outlive its scope.
+int duArenaBegin(); // Returns the new scope's depth, or -1 when too many are open
+void duArenaEnd();
+void* duArenaMalloc(int size); // 0 when no scope is open or the arena is full
+void** duArenaEscape(void* ptr);
+
+// Bulk zeroing and copying used by the collectors. duInitMalloc picks the best kernels the CPU supports;
+// duSetKernelLevel forces a lower one and returns the level actually in use. Scalar means memset and memcpy.
+#define DU_KERNEL_SCALAR 0
+#define DU_KERNEL_SSE2 1
+#define DU_KERNEL_AVX2 2
+#define DU_KERNEL_AVX512 3
+#define DU_KERNEL_BEST DU_KERNEL_AVX512
+
+int duSetKernelLevel(int level);
+void duBulkZero(void* dest, long bytes);
+void duBulkCopy(void* dest, const void* src, long bytes); // The ranges must not overlap
+
+// Heap images: duHeapSave writes the heaps, handle table and collector state to a file, and duHeapMap
+// brings them back in a later run of the same build in place of duManagedInitMalloc. Handles keep their
+// slots. Pins, arena scopes, profiles and stats start over. Pointers stored inside blocks are not rebased,
+// so blocks should refer to each other by handle index. Both return 0, or -1 on failure.
+#define DU_HEAP_IMAGE_MAGIC "DUHEAP2"
+
+int duHeapSave(const char* path);
+int duHeapMap(const char* path);
+
+// Weak handles don't keep their block alive: the next collection of the block's generation frees it and
+// sets the handle to 0 instead, unless the block is pinned. Good for caches that can be rebuilt. A cleared
+// handle still has to be released with duManagedFree. With notification on, duNextClearedWeak hands back
+// cleared handles one at a time, oldest first, and 0 when there are none.
+void duSetWeak(void** mptr, int weak); // weak 0 makes the handle strong again
+void duSetWeakNotify(int enabled);
+void** duNextClearedWeak();
+
+// Order minorCollection copies survivors in, which decides what ends up next to what. INDEX is handle
+// order. SITE groups blocks allocated by the same duManagedMalloc call. ACCESS lays blocks out in the order
+// they were last allocated or touched through Managed(), oldest first; touches are only seen where
+// DU_ACCESS_ORDER is defined before including this header.
+#define DU_COPY_ORDER_INDEX 0
+#define DU_COPY_ORDER_SITE 1
+#define DU_COPY_ORDER_ACCESS 2
+
+void duSetCopyOrder(int order); // Applies to blocks allocated from then on
+
+// Direct mode: duDirectMalloc returns the object itself rather than a handle. Collections find direct objects
+// conservatively from the stack and registers of the thread using them, then through each object's first
+// pointerCount words, which have to hold 0 or the start of another direct object. Objects the stack points at,
+// even into the middle, are pinned for that collection; the rest may move, and the pointer fields are updated.
+// Direct objects nothing reaches are freed. Pointers kept anywhere else (globals, malloc'd memory, managed
+// blocks) aren't seen, direct objects made inside a handle scope are freed with it, and heap images keep
+// them only as blocks nothing can free.
+void* duDirectMalloc(int size, int pointerCount); // 0 when out of memory or the stack base is unknown
+void duDirectFree(void* ptr);
+void duSetStackBase(void* base); // Highest stack address; found by itself except in DU_STATIC_HEAP builds
+
+void duSetHandleRecycling(int enabled); // Let duManagedMalloc reuse slots that duManagedFree released
+
+// Handle scopes: every handle created while a scope is open is freed when it closes. Scopes live on the
+// caller's stack and close in the reverse order they were opened. duHandleScopeEscape hands one handle to
+// the enclosing scope; use the handle it returns from then on.
+typedef struct duHandleScope {
+    int escapeSlot; // Slot reserved in the enclosing scope, -1 if the list was full
+    int watermark;  // First slot that belongs to this scope
+} duHandleScope;
+
+void duHandleScopeOpen(duHandleScope* scope);
+void duHandleScopeClose(duHandleScope* scope);
+void** duHandleScopeEscape(duHandleScope* scope, void** mptr); // 0 if the scope has already escaped one
+
+int minorCollection(); // 0, or -1 when heap[2] was full and some survivors were tenured in the nursery instead
 void majorCollection();
+void duSetOldGenMode(int mode);
+// Keeps a bitmap of where heap[2]'s blocks start, so lazy sweeping and compaction step over dead blocks
+// by scanning it and the mark bits instead of reading each block's header
+void duSetSideMetadata(int enabled);
+// Compaction moves blocks of REMAP_THRESHOLD bytes or more by remapping their pages. Each move splits heap[2]
+// into more mappings, and vm.max_map_count limits the whole process, so once REMAP_MAX_MAPPINGS / 2 may have
+// built up the next compaction copies the live part of heap[2] into one fresh mapping. Past REMAP_MAX_MAPPINGS
+// large blocks are copied until that merge works.
+void duSetLargeBlockRemap(int enabled);
+// Threads majorCollection compacts heap[2] with, 0 for one per CPU; returns the number in use. Each takes a
+// stretch of heap[2] holding about the same live bytes, and every stretch but the last keeps its own free
+// space at its end. Small old generations and DU_STATIC_HEAP builds are compacted by one thread.
+int duSetCompactThreads(int threads);
+void duGetStats(duStats* stats);
+unsigned long long duPauseBucketStart(int bucket);
+unsigned long long duPausePercentile(const duPauseHistogram* histogram, double percentile);
+void duTraceEnable(int enabled);
+int duTraceWrite(FILE* out);
+void duProfileSetSampleRate(long long bytes);
+int duProfileWrite(FILE* out, int profile);
+int duHeapSnapshot(FILE* out, int format);
+void duRecordingStart(FILE* out); // Logs every managed call to out until duRecordingStop
+void duRecordingStop();
+
+// Soft heap limit: when a duManagedMalloc would take the heaps' used bytes past it, a minor collection runs
+// first, then a major one if that wasn't enough, then the pressure callbacks get DU_PRESSURE_SOFT so the
+// program can drop caches. The allocation goes ahead either way if there is room. Callbacks also get
+// DU_PRESSURE_CRITICAL when an allocation fails or a minor collection finds heap[2] full.
+// With a limit set, raw pointers taken from handles are only good until the next duManagedMalloc.
+#define DU_HEAP_LIMIT_CGROUP -1 // Pass to duSetHeapLimit to use the container's memory.max
+#define DU_PRESSURE_SOFT 1
+#define DU_PRESSURE_CRITICAL 2
+
+typedef void (*duPressureCallback)(int level, long long usedBytes, long long limitBytes, void* context);
+
+long long duSetHeapLimit(long long bytes); // 0 turns the limit off; returns the limit now in effect
+int duAddPressureCallback(duPressureCallback callback, void* context); // 0, or -1 when all slots are taken
+void duRemovePressureCallback(duPressureCallback callback, void* context);
+
+// Unmanaged path: blocks without a handle. Collections only keep blocks a handle points at, so don't mix the two
+void duInitMalloc(int searchType);
+void* duMalloc(int size);
+void duFree(void* ptr);
+void* duMallocAligned(int size, int alignment); // alignment is a power of two
+int duUsableSize(void* ptr);
+void duAddHeapChunk(void* memory, int size); // Gives the allocator more memory to carve blocks from
+void duSetCoalescing(int enabled); // Merge freed blocks with free neighbours
+
+// Called from duHeapSnapshotPoll with 0 when the snapshot was written, -1 when it failed
+typedef void (*duSnapshotCallback)(int status, void* context);
+
+// Writes the snapshot from a forked child. Returns a descriptor that becomes readable when the child is done,
+// or -1 when too many snapshots are running or the fork failed
+int duHeapSnapshotAsync(const char* path, int format, duSnapshotCallback done, void* context);
+int duHeapSnapshotPoll(int wait); // Reaps finished snapshots and runs their callbacks; returns how many still run
 
+#ifdef DU_ACCESS_ORDER
+// Stamps the handle with an access clock for DU_COPY_ORDER_ACCESS; p is evaluated twice
+extern void* managedList[];
+extern unsigned int duAccessClock;
+extern unsigned int duAccessStamp[];
+#define Managed(p) (*(duAccessStamp[(void**)(p) - managedList] = ++duAccessClock, (p)))
+#else
 #define Managed(p) (*p)
+#endif
 #define Managed_t(t) t*
 
 #endif
\ No newline at end of file
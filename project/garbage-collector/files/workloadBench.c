@@ -0,0 +1,355 @@
+// Synthetic allocation workloads, run against one allocator chosen at build time:
+//   -DBENCH_V1 .. -DBENCH_V4 for the lab versions, -DBENCH_SYSTEM for the C library's malloc
+// Each run prints one JSON object for one workload and strategy:
+//   workloadBench <fixed_churn|pareto_lifetimes|producer_consumer|large_mix> <first|best> [ops]
+// runWorkloadBench.sh builds every version and gathers all the runs into one JSON document.
+//
+// The heap and handle table sizes have to match the allocator's, e.g.
+//   cp v4_dumalloc.h dumalloc.h
+//   gcc -O2 -DBENCH_V4 -DHEAP_SIZE=4194304 -DMAX_MANAGED=210000 -o workloadBench workloadBench.c v4_dumalloc.c -lm
+
+#include <stdio.h>  // printf
+#include <stdlib.h>  // malloc, qsort
+#include <string.h>  // memset
+#include <math.h>  // pow
+#include <time.h>  // clock_gettime
+
+#ifdef BENCH_SYSTEM
+#include <malloc.h>  // mallinfo2
+#define FIRST_FIT 0
+#define BEST_FIT 1
+#else
+#include "dumalloc.h"
+#endif
+
+#ifndef HEAP_SIZE
+#define HEAP_SIZE (4 * 1024 * 1024)
+#endif
+
+#define DEFAULT_OPS 200000
+#define CHURN_SLOTS 1024 // Live objects in fixed_churn
+#define CHURN_SIZE 64
+#define WHEEL_SIZE 8192 // Longest lifetime in pareto_lifetimes, in allocations
+#define PARETO_ALPHA 1.2 // Lifetime tail; smaller is heavier
+#define PARETO_MIN_LIFETIME 32 // Shortest lifetime, in allocations
+#define QUEUE_SIZE 4096 // Messages producer_consumer can have in flight
+#define BURST 64 // Longest run of produces or consumes
+#define MIX_SLOTS 2048 // Live objects in large_mix
+#define LARGE_PERCENT 5 // Share of large_mix allocations that are large (4 to 32 KiB)
+#define FOOTPRINT_INTERVAL 1024 // Ops between footprint samples for system malloc
+
+// ---------------------------------------------------------------
+// Allocator adapters: allocate, free, reach the data and collect
+// ---------------------------------------------------------------
+#if defined(BENCH_SYSTEM)
+#define ALLOCATOR_NAME "glibc"
+typedef void* handle;
+void benchInit(int strategy) { (void)strategy; }
+handle benchAlloc(int size) { return malloc(size); }
+void benchFree(handle h) { free(h); }
+void* benchData(handle h) { return h; }
+int benchCollect(int level) { (void)level; return 0; } // Nothing to collect
+long long benchFootprint() {
+	struct mallinfo2 info = mallinfo2();
+	return info.arena + info.hblkhd; // Heap obtained with brk plus mmapped chunks
+}
+#elif defined(BENCH_V1)
+#define ALLOCATOR_NAME "v1"
+typedef void* handle;
+void benchInit(int strategy) { duInitMalloc(strategy); }
+handle benchAlloc(int size) { return duMalloc(size); }
+void benchFree(handle h) { duFree(h); }
+void* benchData(handle h) { return h; }
+int benchCollect(int level) { (void)level; return 0; }
+long long benchFootprint() { return HEAP_SIZE; }
+#elif defined(BENCH_V2)
+#define ALLOCATOR_NAME "v2"
+typedef void** handle;
+void benchInit(int strategy) { duManagedInitMalloc(strategy); }
+handle benchAlloc(int size) { return duManagedMalloc(size); }
+void benchFree(handle h) { duManagedFree(h); }
+void* benchData(handle h) { return *h; }
+int benchCollect(int level) { (void)level; return 0; }
+long long benchFootprint() { return HEAP_SIZE; }
+#elif defined(BENCH_V3)
+#define ALLOCATOR_NAME "v3"
+typedef void** handle;
+void benchInit(int strategy) { duManagedInitMalloc(strategy); }
+handle benchAlloc(int size) { return duManagedMalloc(size); }
+void benchFree(handle h) { duManagedFree(h); }
+void* benchData(handle h) { return *h; }
+int benchCollect(int level) {
+	if (level > 0) {
+		return 0;
+	}
+	minorCollection();
+	return 1;
+}
+long long benchFootprint() { return 2LL * HEAP_SIZE; } // Two semispaces
+#elif defined(BENCH_V4)
+#define ALLOCATOR_NAME "v4"
+typedef void** handle;
+void benchInit(int strategy) { duManagedInitMalloc(strategy); }
+handle benchAlloc(int size) { return duManagedMalloc(size); }
+void benchFree(handle h) { duManagedFree(h); }
+void* benchData(handle h) { return *h; }
+int benchCollect(int level) {
+	// A minor collection first, then make room in the old generation for the next one's promotions
+	if (level == 0 || level == 2) {
+		minorCollection();
+		return 1;
+	}
+	if (level == 1) {
+		majorCollection();
+		return 1;
+	}
+	return 0;
+}
+long long benchFootprint() { return 3LL * HEAP_SIZE; } // Two semispaces and the old generation
+#else
+#error "Pick an allocator with -DBENCH_V1, -DBENCH_V2, -DBENCH_V3, -DBENCH_V4 or -DBENCH_SYSTEM"
+#endif
+
+// ---------------------------------------------------------------
+// Measurement
+// ---------------------------------------------------------------
+long long* opNs; // Latency of every op
+long long opCount = 0;
+long long opLimit;
+long long* pauseNs; // Every collection the benchmark had to run
+long long pauseCount = 0;
+long long failures = 0; // Allocations that failed even after collecting
+long long liveBytes = 0;
+long long peakLiveBytes = 0;
+long long peakFootprint = 0;
+unsigned long long randomState = 88172645463325252ULL;
+
+long long clockNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+unsigned long long nextRandom() {
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 7;
+	randomState ^= randomState << 17;
+	return randomState;
+}
+
+int randomBelow(int limit) {
+	return (int)(nextRandom() % limit);
+}
+
+void sampleFootprint() {
+	long long footprint = benchFootprint();
+	if (footprint > peakFootprint) {
+		peakFootprint = footprint;
+	}
+}
+
+handle allocate(int size) {
+	long long start = clockNs();
+	handle h = benchAlloc(size);
+
+	for (int level = 0; h == NULL; level++) {
+		long long pauseStart = clockNs();
+		if (!benchCollect(level)) {
+			break;
+		}
+		pauseNs[pauseCount++ % opLimit] = clockNs() - pauseStart;
+		h = benchAlloc(size);
+	}
+
+	if (h != NULL) {
+		memset(benchData(h), (int)size, size); // Touch it the way an initializer would
+		liveBytes += size;
+		if (liveBytes > peakLiveBytes) {
+			peakLiveBytes = liveBytes;
+		}
+	}
+	else {
+		failures++;
+	}
+
+	opNs[opCount++] = clockNs() - start;
+
+	if (opCount % FOOTPRINT_INTERVAL == 0) {
+		sampleFootprint();
+	}
+
+	return h;
+}
+
+void release(handle h, int size) {
+	long long start = clockNs();
+
+	if (h != NULL) {
+		benchFree(h);
+		liveBytes -= size;
+	}
+
+	opNs[opCount++] = clockNs() - start;
+}
+
+int compareLongLong(const void* a, const void* b) {
+	long long x = *(const long long*)a;
+	long long y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+long long percentile(long long* sorted, long long count, double p) {
+	if (count == 0) {
+		return 0;
+	}
+	long long index = (long long)(p / 100.0 * (count - 1) + 0.5);
+	return sorted[index];
+}
+
+// ---------------------------------------------------------------
+// Workloads; each runs until it has done opLimit allocations and frees
+// ---------------------------------------------------------------
+void fixedChurn() {
+	handle slots[CHURN_SLOTS];
+
+	for (int i = 0; i < CHURN_SLOTS; i++) {
+		slots[i] = allocate(CHURN_SIZE);
+	}
+
+	while (opCount + 2 <= opLimit) {
+		int i = randomBelow(CHURN_SLOTS);
+		release(slots[i], CHURN_SIZE);
+		slots[i] = allocate(CHURN_SIZE);
+	}
+}
+
+void paretoLifetimes() {
+	// Objects wait in the bucket of the allocation count at which they die
+	static handle objects[WHEEL_SIZE];
+	static int sizes[WHEEL_SIZE];
+	static int next[WHEEL_SIZE];
+	static int bucket[WHEEL_SIZE];
+	int freeSlot = 0;
+
+	for (int i = 0; i < WHEEL_SIZE; i++) {
+		next[i] = i + 1; // Unused slots chain from freeSlot
+		bucket[i] = -1;
+	}
+	next[WHEEL_SIZE - 1] = -1;
+
+	for (long long tick = 0; opCount + 2 <= opLimit; tick++) {
+		for (int i = bucket[tick % WHEEL_SIZE]; i >= 0; ) {
+			int following = next[i];
+			release(objects[i], sizes[i]);
+			next[i] = freeSlot;
+			freeSlot = i;
+			i = following;
+		}
+		bucket[tick % WHEEL_SIZE] = -1;
+
+		double u = (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+		long long lifetime = (long long)(PARETO_MIN_LIFETIME / pow(1.0 - u, 1.0 / PARETO_ALPHA));
+		if (lifetime >= WHEEL_SIZE) {
+			lifetime = WHEEL_SIZE - 1; // Longer-lived objects are cut off at the wheel size
+		}
+		if (lifetime < 1) {
+			lifetime = 1;
+		}
+
+		int i = freeSlot;
+		freeSlot = next[i];
+		sizes[i] = 16 + randomBelow(241);
+		objects[i] = allocate(sizes[i]);
+
+		int due = (tick + lifetime) % WHEEL_SIZE;
+		next[i] = bucket[due];
+		bucket[due] = i;
+	}
+}
+
+void producerConsumer() {
+	static handle queue[QUEUE_SIZE];
+	static int sizes[QUEUE_SIZE];
+	long long head = 0;
+	long long tail = 0;
+
+	// Bursts stop at opLimit, so the last ones come out short rather than the run
+	while (opCount < opLimit) {
+		for (int burst = 1 + randomBelow(BURST); burst > 0 && tail - head < QUEUE_SIZE && opCount < opLimit; burst--) {
+			int size = 32 + randomBelow(481);
+			sizes[tail % QUEUE_SIZE] = size;
+			queue[tail % QUEUE_SIZE] = allocate(size);
+			tail++;
+		}
+		for (int burst = 1 + randomBelow(BURST); burst > 0 && head < tail && opCount < opLimit; burst--) {
+			release(queue[head % QUEUE_SIZE], sizes[head % QUEUE_SIZE]);
+			head++;
+		}
+	}
+}
+
+void largeMix() {
+	static handle slots[MIX_SLOTS];
+	static int sizes[MIX_SLOTS];
+
+	while (opCount + 1 <= opLimit) {
+		int i = randomBelow(MIX_SLOTS);
+
+		if (sizes[i] != 0) {
+			release(slots[i], sizes[i]);
+			sizes[i] = 0;
+		}
+		else {
+			sizes[i] = (randomBelow(100) < LARGE_PERCENT) ? 4096 + randomBelow(28673) : 16 + randomBelow(113);
+			slots[i] = allocate(sizes[i]);
+		}
+	}
+}
+
+void printPercentiles(long long* values, long long count) {
+	qsort(values, count, sizeof(long long), compareLongLong);
+	printf("{\"count\":%lld,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%lld}", count,
+		percentile(values, count, 50), percentile(values, count, 90), percentile(values, count, 99),
+		percentile(values, count, 99.9), (count > 0) ? values[count - 1] : 0);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		printf("Usage: %s <fixed_churn|pareto_lifetimes|producer_consumer|large_mix> <first|best> [ops]\n", argv[0]);
+		return 1;
+	}
+
+	const char* workload = argv[1];
+	int strategy = (strcmp(argv[2], "best") == 0) ? BEST_FIT : FIRST_FIT;
+	opLimit = (argc > 3) ? atoll(argv[3]) : DEFAULT_OPS;
+	opNs = malloc(opLimit * sizeof(long long));
+	pauseNs = malloc(opLimit * sizeof(long long));
+
+	benchInit(strategy);
+
+	long long start = clockNs();
+
+	if (strcmp(workload, "fixed_churn") == 0) fixedChurn();
+	else if (strcmp(workload, "pareto_lifetimes") == 0) paretoLifetimes();
+	else if (strcmp(workload, "producer_consumer") == 0) producerConsumer();
+	else if (strcmp(workload, "large_mix") == 0) largeMix();
+	else {
+		printf("Unknown workload %s\n", workload);
+		return 1;
+	}
+
+	double seconds = (clockNs() - start) / 1e9;
+	sampleFootprint();
+
+	printf("{\"allocator\":\"%s\",\"strategy\":\"%s\",\"workload\":\"%s\",\"heap_size\":%d,\"ops\":%lld,\"seconds\":%.6f,\"ops_per_sec\":%.0f,",
+		ALLOCATOR_NAME, (strategy == FIRST_FIT) ? "first_fit" : "best_fit", workload, HEAP_SIZE, opCount, seconds, opCount / seconds);
+	printf("\"failures\":%lld,\"peak_live_bytes\":%lld,\"footprint_bytes\":%lld,\"memory_overhead\":%.3f,",
+		failures, peakLiveBytes, peakFootprint, (peakLiveBytes > 0) ? (double)peakFootprint / peakLiveBytes : 0.0);
+	printf("\"ns_per_op\":");
+	printPercentiles(opNs, opCount);
+	printf(",\"gc_pause_ns\":");
+	printPercentiles(pauseNs, (pauseCount < opLimit) ? pauseCount : opLimit);
+	printf("}\n");
+
+	return 0;
+}